@@ -0,0 +1,257 @@
+/**
+ * \file fireloop-bench.cpp
+ * Micro benchmarks of FireLoop and ActionRepository hot paths: parsing of
+ * frame headers (FireLoop::parseFrame), writing responses of a FireLoop
+ * running in this process to a client of its UNIX socket, and dispatch of
+ * commands through ActionRepository::runCmd.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * fireloop-bench is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fireloop.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace actrepo
+{
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * \class BenchActions
+ * @brief Actions of dispatch benchmark.
+ */
+class BenchActions : public ActionList
+{
+public:
+    BenchActions()
+    {
+        push_action(&noop);
+        push_action(&noop, ActionPolicy(64));
+        push_action(&noop, ActionPolicy(0, ActionPolicy::NORMAL, 1000, true, 60000));
+        push_action(&reply);
+    }
+
+    static string noop(ActionSource::Type st, const XParam::XmlNode *rnode, void *data)
+    {
+        return "ok";
+    }
+
+    /**
+     * @brief Answers "size" bytes, the length of the "size" element.
+     */
+    static string reply(ActionSource::Type st, const XParam::XmlNode *rnode, void *data)
+    {
+        static const string response(16384, 'x');
+        Session *session = static_cast<Session *>(data);
+        const char *size = strstr(session->payload, "<size>");
+
+        return response.substr(0, (size == NULL) ? 0 : strtoul(size + 6, NULL, 10));
+    }
+
+protected:
+    virtual string getModule()
+    {
+        return "bench";
+    }
+
+    virtual string getActionName(XParam::XInt cmdID)
+    {
+        const char *names[] = {"noop", "limited", "cached", "reply"};
+
+        return names[cmdID];
+    }
+};
+
+/**
+ * @brief Returns nano seconds per parsed frame header.
+ */
+static double framing(const char *header)
+{
+    const int ITERATIONS = 1000000;
+    size_t size = strlen(header);
+    FrameHeader frame;
+    double start = now();
+    int parsed = 0;
+
+    for (int i = 0; i < ITERATIONS; ++i)
+        parsed += (FireLoop::parseFrame(header, size, frame) > 0);
+
+    return (parsed == ITERATIONS) ? (now() - start) / ITERATIONS : -1;
+}
+
+/**
+ * @brief Connects to UNIX socket "path".
+ * @return socket, or -1 on failure.
+ */
+static int connectTo(const string &path)
+{
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Returns nano seconds per response of "size" bytes, from frame
+ * written to UNIX socket of FireLoop until response is read back.
+ */
+static double writing(const string &path, size_t size)
+{
+    const int ITERATIONS = 20000;
+    string command = "<cmd><sysID>1</sysID><cmdID>3</cmdID><token>bench</token><size>" +
+                     std::to_string(size) + "</size></cmd>";
+    string frame = std::to_string(command.length()) + ";k:" + command;
+    vector<char> buffer(65536);
+    size_t buffered = 0;
+    size_t framed;
+    const char *colon;
+    ssize_t bytesRead;
+    double start;
+    int fd = connectTo(path);
+
+    if (fd == -1)
+        return -1;
+    start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (write(fd, frame.data(), frame.length()) != (ssize_t) frame.length())
+            break;
+        /* Read "length:response" */
+        while (true) {
+            colon = static_cast<const char *>(memchr(&buffer[0], ':', buffered));
+            if (colon != NULL) {
+                framed = colon - &buffer[0] + 1 + strtoul(&buffer[0], NULL, 10);
+                if (buffered >= framed) {
+                    buffered -= framed;
+                    memmove(&buffer[0], &buffer[framed], buffered);
+                    break;
+                }
+            }
+            bytesRead = read(fd, &buffer[buffered], buffer.size() - buffered);
+            if (bytesRead <= 0) {
+                close(fd);
+
+                return -1;
+            }
+            buffered += bytesRead;
+        }
+    }
+    close(fd);
+
+    return (now() - start) / ITERATIONS;
+}
+
+static void *serve(void *)
+{
+    try {
+        FireLoop::loop();
+    } catch (Exception &e) {
+        fprintf(stderr, "FireLoop stopped: %s\n", e.xml().c_str());
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Returns nano seconds per dispatch of command "cid".
+ */
+static double dispatch(XParam::XInt cid, const XParam::XmlNode *rnode)
+{
+    const int ITERATIONS = 1000000;
+    double start = now();
+
+    for (int i = 0; i < ITERATIONS; ++i)
+        ActionRepository::runCmd(1, cid, ActionSource::FIRELOOP, rnode, NULL);
+
+    return (now() - start) / ITERATIONS;
+}
+
+} // namespace actrepo
+
+using namespace actrepo;
+
+int main()
+{
+    const char *headers[] = {"128:", "65536;k;trequest-000042:", "PVB14096;k;c:"};
+    const size_t sizes[] = {64, 1024, 16384};
+    string path = "/tmp/pvm-fireloop-bench-" + std::to_string(getpid()) + ".sock";
+    XParam::XmlParser parser;
+    BenchActions actions;
+    pthread_t server;
+    double elapsed;
+    int fd;
+
+    parser.parse_memory("<cmd><sysID>1</sysID><cmdID>2</cmdID><token>bench</token></cmd>");
+    ActionRepository::init(2);
+    ActionRepository::regActList(1, &actions);
+    ActionList::set_traceLevel(ActionList::TRACE_NONE);
+
+    for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); ++i)
+        printf("framing   %-28s %8.1f ns\n", headers[i], framing(headers[i]));
+
+    /* TCP listener isn't used; it takes a free port. Wait for listeners */
+    FireLoop::init();
+    FireLoop::set_ip("127.0.0.1");
+    FireLoop::set_port(0);
+    FireLoop::set_unixSocket(path);
+    pthread_create(&server, NULL, serve, NULL);
+    for (int i = 0; i < 500; ++i) {
+        fd = connectTo(path);
+        if (fd != -1) {
+            close(fd);
+            break;
+        }
+        usleep(10000);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        elapsed = writing(path, sizes[i]);
+        printf("write     %-28zu %8.1f ns\n", sizes[i], elapsed);
+        if (elapsed < 0) {
+            unlink(path.c_str());
+            _exit(1);
+        }
+    }
+    printf("dispatch  %-28s %8.1f ns\n", "runCmd", dispatch(0, NULL));
+    printf("dispatch  %-28s %8.1f ns\n", "runCmd, limited action", dispatch(1, NULL));
+    printf("dispatch  %-28s %8.1f ns\n", "runCmd, cached action",
+           dispatch(2, parser.get_document()->get_root_node()));
+    fflush(stdout);
+    unlink(path.c_str());
+    /* FireLoop never returns; leave without tearing it down */
+    _exit(0);
+}
@@ -0,0 +1,351 @@
+/**
+ * \file loadgen.cpp
+ * Load generator that drives the real FireLoop::loop() over its UNIX
+ * socket and loopback TCP, and reports throughput and latency percentiles.
+ *
+ * FireLoop runs in this process, with an action list whose action sleeps
+ * for the configured latency; client threads send keep-alive framed
+ * commands with a payload of the configured size, one at a time per
+ * connection.
+ *
+ * Usage: loadgen [-c concurrency] [-n requests] [-s payload] [-l latency]
+ *                [-p port] [-u | -t]
+ * - concurrency: client connections (16),
+ * - requests: requests per transport (20000),
+ * - payload: bytes of command payload (128),
+ * - latency: micro seconds each action sleeps (0),
+ * - port: loopback TCP port, zero picks a free one (0),
+ * - "-u" or "-t" runs UNIX socket or TCP only; both by default.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * loadgen is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fireloop.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace actrepo;
+
+/**
+ * @brief Transports of commands.
+ */
+enum
+{
+    UNIX,
+    TCP,
+    TRANSPORTS
+};
+
+static const char *transportString[TRANSPORTS] = {"unix", "tcp"};
+
+static unsigned int concurrency = 16;
+static unsigned int requests = 20000;
+static unsigned int payload = 128;
+static unsigned int latency = 0;
+static int port = 0;
+static string unixPath;
+
+/**
+ * \class LoadActions
+ * @brief Action list served to load generator.
+ */
+class LoadActions : public ActionList
+{
+public:
+    LoadActions()
+    {
+        push_action(&sleep);
+    }
+
+    /**
+     * @brief Sleeps for "latency", then answers.
+     */
+    static string sleep(ActionSource::Type st, const XParam::XmlNode *rnode, void *data)
+    {
+        if (latency > 0)
+            usleep(latency);
+
+        return "ok";
+    }
+
+protected:
+    virtual string getModule()
+    {
+        return "loadgen";
+    }
+
+    virtual string getActionName(XParam::XInt cmdID)
+    {
+        return "sleep";
+    }
+};
+
+/**
+ * \struct Client
+ * @brief A client connection and its measurements.
+ */
+struct Client {
+    int transport;
+    unsigned int requests;
+    vector<double> latencies;
+    unsigned int errors;
+};
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Connects to FireLoop over a transport.
+ * @return socket, or -1 on failure.
+ */
+static int connectTo(int transport)
+{
+    struct sockaddr_un unixAddress;
+    struct sockaddr_in tcpAddress;
+    int fd;
+    int result;
+
+    if (transport == UNIX) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&unixAddress, 0, sizeof(unixAddress));
+        unixAddress.sun_family = AF_UNIX;
+        strncpy(unixAddress.sun_path, unixPath.c_str(), sizeof(unixAddress.sun_path) - 1);
+        result = connect(fd, (struct sockaddr *) &unixAddress, sizeof(unixAddress));
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        memset(&tcpAddress, 0, sizeof(tcpAddress));
+        tcpAddress.sin_family = AF_INET;
+        tcpAddress.sin_port = htons(port);
+        tcpAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        result = connect(fd, (struct sockaddr *) &tcpAddress, sizeof(tcpAddress));
+    }
+    if (result == -1) {
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Reads one response frame into "buffer", which keeps bytes read
+ * beyond it.
+ * @return false when connection is closed.
+ */
+static bool readResponse(int fd, string &buffer, string &response)
+{
+    char chunk[65536];
+    size_t colon;
+    size_t length;
+    ssize_t bytesRead;
+
+    while (true) {
+        colon = buffer.find(':');
+        if (colon != string::npos) {
+            length = strtoul(buffer.c_str(), NULL, 10);
+            if (buffer.length() >= colon + 1 + length) {
+                response.assign(buffer, colon + 1, length);
+                buffer.erase(0, colon + 1 + length);
+
+                return true;
+            }
+        }
+        bytesRead = read(fd, chunk, sizeof(chunk));
+        if (bytesRead <= 0)
+            return false;
+        buffer.append(chunk, bytesRead);
+    }
+}
+
+static void *runClient(void *_client)
+{
+    Client *client = static_cast<Client *>(_client);
+    string command = "<cmd><sysID>1</sysID><cmdID>0</cmdID><token>loadgen</token><params>" +
+                     string(payload, 'x') + "</params></cmd>";
+    string frame = std::to_string(command.length()) + ";k:" + command;
+    string buffer;
+    string response;
+    double start;
+    int fd = connectTo(client->transport);
+
+    if (fd == -1) {
+        client->errors = client->requests;
+
+        return NULL;
+    }
+    client->latencies.reserve(client->requests);
+    for (unsigned int i = 0; i < client->requests; ++i) {
+        start = now();
+        if ((write(fd, frame.data(), frame.length()) != (ssize_t) frame.length()) ||
+            ! readResponse(fd, buffer, response)) {
+            client->errors += client->requests - i;
+            break;
+        }
+        client->latencies.push_back(now() - start);
+        if (response.find(ResponseStatus::typeString[ResponseStatus::SUCCESS]) == string::npos)
+            client->errors++;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+static void *serve(void *)
+{
+    try {
+        FireLoop::loop();
+    } catch (Exception &e) {
+        fprintf(stderr, "FireLoop stopped: %s\n", e.xml().c_str());
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Drives FireLoop over a transport and prints its results.
+ * @return false when some requests failed.
+ */
+static bool run(int transport)
+{
+    vector<Client> clients(concurrency);
+    vector<pthread_t> threads(concurrency);
+    vector<double> latencies;
+    unsigned int errors = 0;
+    double start;
+    double elapsed;
+
+    for (unsigned int i = 0; i < concurrency; ++i) {
+        clients[i].transport = transport;
+        clients[i].requests = requests / concurrency + (i < requests % concurrency);
+        clients[i].errors = 0;
+    }
+    start = now();
+    for (unsigned int i = 0; i < concurrency; ++i)
+        pthread_create(&threads[i], NULL, runClient, &clients[i]);
+    for (unsigned int i = 0; i < concurrency; ++i)
+        pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+
+    for (unsigned int i = 0; i < concurrency; ++i) {
+        latencies.insert(latencies.end(), clients[i].latencies.begin(),
+                         clients[i].latencies.end());
+        errors += clients[i].errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    if (latencies.empty()) {
+        printf("%-4s  no response\n", transportString[transport]);
+
+        return false;
+    }
+    printf("%-4s  %8.0f req/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  errors %u\n",
+           transportString[transport], latencies.size() / (elapsed / 1e9),
+           latencies[latencies.size() * 50 / 100] / 1e3,
+           latencies[latencies.size() * 99 / 100] / 1e3,
+           latencies[latencies.size() * 999 / 1000] / 1e3, errors);
+
+    return errors == 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool transports[TRANSPORTS] = {true, true};
+    LoadActions actions;
+    pthread_t server;
+    bool passed = true;
+    int option;
+    int fd;
+
+    while ((option = getopt(argc, argv, "c:n:s:l:p:ut")) != -1) {
+        switch (option) {
+        case 'c':
+            concurrency = std::max(1, atoi(optarg));
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 's':
+            payload = atoi(optarg);
+            break;
+        case 'l':
+            latency = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            transports[TCP] = false;
+            break;
+        case 't':
+            transports[UNIX] = false;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c concurrency] [-n requests] [-s payload] "
+                            "[-l latency] [-p port] [-u | -t]\n",
+                    argv[0]);
+
+            return 2;
+        }
+    }
+
+    unixPath = "/tmp/pvm-loadgen-" + std::to_string(getpid()) + ".sock";
+    unlink(unixPath.c_str());
+    ActionRepository::init(2);
+    ActionRepository::regActList(1, &actions);
+    ActionList::set_traceLevel(ActionList::TRACE_NONE);
+    FireLoop::init();
+    FireLoop::set_ip("127.0.0.1");
+    FireLoop::set_port(port);
+    FireLoop::set_unixSocket(unixPath);
+    pthread_create(&server, NULL, serve, NULL);
+
+    /* Wait for listeners */
+    for (int i = 0; i < 500; ++i) {
+        fd = connectTo(UNIX);
+        if (fd != -1) {
+            close(fd);
+            break;
+        }
+        usleep(10000);
+    }
+
+    /* Port that FireLoop has picked, when it's zero */
+    port = FireLoop::get_port();
+    printf("concurrency %u, %u requests, payload %u bytes, action latency %u us, port %d\n",
+           concurrency, requests, payload, latency, port);
+    for (int transport = 0; transport < TRANSPORTS; ++transport) {
+        if (transports[transport] && ! run(transport))
+            passed = false;
+    }
+    fflush(stdout);
+    unlink(unixPath.c_str());
+    /* FireLoop never returns; leave without tearing it down */
+    _exit(passed ? 0 : 1);
+}
@@ -0,0 +1,107 @@
+/**
+ * \file parser-bench.cpp
+ * Counts heap allocations (operator new) and time per command of
+ * Cmd::loadXmlStr with a fresh XmlParser, as fire() did, and with a parser
+ * reused by the worker thread; both build a fresh Cmd, as fire() does.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * parser-bench is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fireloop.hpp"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+using namespace actrepo;
+
+static const int ITERATIONS = 100000;
+
+static unsigned long long allocations = 0;
+
+void *operator new(size_t size)
+{
+    void *memory;
+
+    allocations++;
+    memory = malloc(size ? size : 1);
+    if (memory == NULL)
+        throw std::bad_alloc();
+
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+    const string command = "<?xml version=\"1.0\"?><cmd><sysID>1</sysID><cmdID>2</cmdID>"
+                           "<token>bench</token><params><vm>guest-01</vm></params></cmd>";
+    XParam::XmlParser parser;
+    unsigned long long before;
+    double start;
+    double freshTime;
+    double reusedTime;
+    double freshAllocations;
+    double reusedAllocations;
+
+    /* Warm up both paths */
+    {
+        Cmd warm;
+
+        warm.loadXmlStr(command, &parser);
+    }
+
+    before = allocations;
+    start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        Cmd fresh;
+        XParam::XmlParser freshParser;
+
+        fresh.loadXmlStr(command, &freshParser);
+    }
+    freshTime = (now() - start) / ITERATIONS;
+    freshAllocations = (double) (allocations - before) / ITERATIONS;
+
+    before = allocations;
+    start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        Cmd reused;
+
+        reused.loadXmlStr(command, &parser);
+    }
+    reusedTime = (now() - start) / ITERATIONS;
+    reusedAllocations = (double) (allocations - before) / ITERATIONS;
+
+    printf("fresh parser:  %8.1f ns  %6.1f allocs/op\n", freshTime, freshAllocations);
+    printf("reused parser: %8.1f ns  %6.1f allocs/op\n", reusedTime, reusedAllocations);
+
+    return (reusedAllocations <= freshAllocations) ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+/**
+ * \file response-bench.cpp
+ * Compares building responses through Response::xml() with
+ * Response::serialize(), and checks that both produce the same bytes.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * response-bench is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fireloop.hpp"
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace actrepo;
+
+static const int ITERATIONS = 200000;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static string generic(const int status, const string &description)
+{
+    Response response;
+
+    response.set_status(status);
+    response.set_description(description);
+
+    return response.xml();
+}
+
+int main()
+{
+    const string descriptions[] = {
+        "",
+        "done",
+        "<vm><name>guest-01</name><state>running</state><vcpu>4</vcpu></vm>",
+        "quotes \" and ' and & and <tags> and\ttabs\r\n",
+        string(16384, 'x'),
+    };
+    const char *names[] = {"empty", "short", "xml", "escaped", "16KiB"};
+    string out;
+    double start;
+    double genericTime;
+    double fastTime;
+    int failed = 0;
+
+    for (size_t d = 0; d < sizeof(names) / sizeof(names[0]); ++d) {
+        for (int s = 0; s < ResponseStatus::MAX; ++s) {
+            out.clear();
+            Response::serialize(out, s, descriptions[d]);
+            if (out != generic(s, descriptions[d])) {
+                printf("MISMATCH %s/%d\n", names[d], s);
+                failed++;
+            }
+        }
+
+        start = now();
+        for (int i = 0; i < ITERATIONS; ++i)
+            out = generic(ResponseStatus::SUCCESS, descriptions[d]);
+        genericTime = (now() - start) / ITERATIONS;
+
+        start = now();
+        for (int i = 0; i < ITERATIONS; ++i) {
+            out.clear();
+            Response::serialize(out, ResponseStatus::SUCCESS, descriptions[d]);
+        }
+        fastTime = (now() - start) / ITERATIONS;
+
+        printf("%-8s xml(): %9.1f ns  serialize(): %9.1f ns  speedup: %5.1fx\n", names[d],
+               genericTime, fastTime, genericTime / fastTime);
+    }
+
+    return failed ? 1 : 0;
+}
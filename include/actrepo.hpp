@@ -28,10 +28,15 @@
  */
 #pragma once
 
+#include "cache.hpp"
 #include "config.h"
+#include "gate.hpp"
+#include "metrics.hpp"
 #include "plogger.hpp"
 
+#include <atomic>
 #include <putil/cmd.hpp>
+#include <unistd.h>
 
 using namespace putil;
 
@@ -54,6 +59,226 @@ public:
     };
 };
 
+/**
+ * \class ActionPolicy
+ * @brief Scheduling metadata of an action, given at registration.
+ */
+class ActionPolicy
+{
+public:
+    /**
+     * @brief Priority classes; each one is a lane with its own limit on
+     * running actions (ActionRepository::set_laneLimit) and its own queue of
+     * commands waiting for workers, drained highest priority first.
+     */
+    enum Priority
+    {
+        HIGH,   /**< Latency sensitive, e.g. status queries */
+        NORMAL, /**< Default */
+        LOW,    /**< Heavy or long running, e.g. migrations */
+        PRIORITIES
+    };
+
+    /**
+     * @brief ActionPolicy constructor.
+     * @param maxConcurrency maximum number of running instances of action,
+     * zero if unlimited.
+     * @param priority priority lane of action.
+     * @param queueTimeout milli seconds a command waits in workers queue of
+     * its priority before it's rejected; zero if unlimited. Commands that
+     * find action or lane full are rejected at once.
+     * @param parse whether action reads parsed command (rnode); for actions
+     * that don't, FireLoop doesn't build the tree and passes NULL.
+     * @param cacheTTL milli seconds that result of a read-only action is
+     * served to identical commands without running it again, zero if not
+     * cacheable. Commands are identical by their tree, so it needs "parse".
+     */
+    ActionPolicy(unsigned int maxConcurrency = 0, Priority priority = NORMAL,
+                 unsigned int queueTimeout = 1000, bool parse = true, unsigned int cacheTTL = 0)
+        : maxConcurrency(maxConcurrency),
+          priority(priority),
+          queueTimeout(queueTimeout),
+          parse(parse),
+          cacheTTL(cacheTTL)
+    {
+    }
+
+    unsigned int maxConcurrency;
+    Priority priority;
+    unsigned int queueTimeout;
+    bool parse;
+    unsigned int cacheTTL;
+};
+
+/**
+ * \class ResponseWriter
+ * @brief Sink that streaming actions write their result into.
+ *
+ * @note Depending on caller, written data may be sent to user in chunks
+ * while action is still running, or be collected and returned at the end.
+ */
+class ResponseWriter
+{
+public:
+    virtual ~ResponseWriter();
+
+    /**
+     * @brief Append data to action result.
+     * @param data data to be appended.
+     * @param length length of data.
+     *
+     * @note May block until previously written data is consumed.
+     */
+    virtual void write(const char *data, size_t length) = 0;
+
+    /**
+     * @brief Append string to action result.
+     * @param data data to be appended.
+     */
+    void write(const string &data);
+};
+
+/**
+ * \class StringWriter
+ * @brief Collects action result into a string.
+ */
+class StringWriter : public ResponseWriter
+{
+public:
+    /**
+     * @brief StringWriter constructor.
+     * @param result string that collects written data.
+     */
+    StringWriter(string &result);
+
+    virtual void write(const char *data, size_t length);
+
+    using ResponseWriter::write;
+
+private:
+    /**
+     * @brief Collected result.
+     */
+    string &result;
+};
+
+/**
+ * \class AsyncResult
+ * @brief Completion of an asynchronous action (FT_asyncAction).
+ *
+ * The action starts its work and returns; it, or whatever thread its work
+ * ends on, then calls done() or fail() exactly once. Later calls are
+ * ignored.
+ */
+class AsyncResult
+{
+public:
+    AsyncResult();
+
+    virtual ~AsyncResult();
+
+    /**
+     * @brief Complete action with its result; could be called from any
+     * thread.
+     * @param result result of action.
+     */
+    void done(const string &result);
+
+    /**
+     * @brief Complete action with a failure; could be called from any
+     * thread.
+     * @param exception failure of action.
+     */
+    void fail(const Exception &exception);
+
+protected:
+    /**
+     * @brief Called once, by done(), when action is complete.
+     *
+     * @note The result may be deleted from here on; base class doesn't
+     * touch it after this call.
+     */
+    virtual void resolved(const string &result) = 0;
+
+    /**
+     * @brief Called once, by fail(), when action is failed.
+     */
+    virtual void rejected(const Exception &exception) = 0;
+
+private:
+    /**
+     * @brief Records metrics of action, then releases what
+     * ActionRepository::startCmd() held for it.
+     * @param failed whether action is failed.
+     */
+    void finish(bool failed);
+
+private:
+    /**
+     * @brief Set once result is complete.
+     */
+    std::atomic<bool> completed;
+
+    /**
+     * @brief Command of action, and time it's started.
+     */
+    long sid;
+    long cid;
+    unsigned long long started;
+
+    /**
+     * @brief Gates entered by action, NULL if none.
+     */
+    Gate *actionGate;
+    Gate *laneGate;
+
+    /**
+     * @brief In-flight counter of pinned sub-system, NULL if not pinned.
+     */
+    std::atomic<unsigned long> *inflight;
+
+    friend class ActionRepository;
+};
+
+/**
+ * \class BlockingResult
+ * @brief Waits for an asynchronous action, for callers that need its
+ * result at once.
+ */
+class BlockingResult : public AsyncResult
+{
+public:
+    BlockingResult();
+
+    virtual ~BlockingResult();
+
+    /**
+     * @brief Waits until action is complete.
+     * @return result of action; throws the failure of action.
+     */
+    string wait();
+
+protected:
+    virtual void resolved(const string &result);
+    virtual void rejected(const Exception &exception);
+
+private:
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /**
+     * @brief Whether action is complete.
+     */
+    bool ready;
+
+    string result;
+
+    /**
+     * @brief Failure of action, NULL on success.
+     */
+    Exception *error;
+};
+
 /**
  * \class ActionList
  * @brief Defines list of actions that corresponds to user commands in sub-systems.
@@ -81,10 +306,30 @@ public:
  * 	}
  * };
  * @endcode
+ *
+ * @note Actions that produce large results could be registered as
+ * streaming actions (FT_streamAction); they write their result into a
+ * ResponseWriter piece by piece, which FireLoop sends in chunks to users
+ * that accept chunked responses.
+ *
+ * @note Actions that wait on disk, libvirt or other IPC could be registered
+ * as asynchronous actions (FT_asyncAction); they start their work and
+ * return, and complete an AsyncResult later. FireLoop then answers the
+ * user on its reactor, so few workers keep many slow commands in flight.
  */
 class ActionList
 {
 public:
+    /**
+     * @brief Tracing levels of actions.
+     */
+    enum TraceLevel
+    {
+        TRACE_NONE,    /**< No thread info nor function tracing */
+        TRACE_SAMPLED, /**< One of every "sampleRate" runs is traced */
+        TRACE_ALL      /**< Every run is traced */
+    };
+
     /**
      * @typedef FT_action
      * defines cmd prototype that would be fired in response to user
@@ -95,6 +340,62 @@ public:
      */
     typedef string (*FT_action)(ActionSource::Type st, const XParam::XmlNode *rnode, void *data);
 
+    /**
+     * @typedef FT_streamAction
+     * defines streaming cmd prototype, that writes its result into "writer"
+     * instead of returning it.
+     * @param st Type of action source.
+     * @param rnode pointer to root node of parsed xml-formatted command.
+     * @param data associated data with rnode.
+     * @param writer sink of action result.
+     */
+    typedef void (*FT_streamAction)(ActionSource::Type st, const XParam::XmlNode *rnode,
+                                    void *data, ResponseWriter *writer);
+
+    /**
+     * @typedef FT_asyncAction
+     * defines asynchronous cmd prototype, that completes "result" when its
+     * work is done, possibly after it returns and on another thread.
+     * @param st Type of action source.
+     * @param rnode pointer to root node of parsed xml-formatted command;
+     * valid until action returns.
+     * @param data associated data with rnode; valid until result is complete.
+     * @param result completion of action.
+     */
+    typedef void (*FT_asyncAction)(ActionSource::Type st, const XParam::XmlNode *rnode,
+                                   void *data, AsyncResult *result);
+
+    ActionList();
+
+    virtual ~ActionList();
+
+    /**
+     * @brief Set how runs of actions are traced. A traced run sets PLogger
+     * thread info (module and action names) and traces function calls;
+     * other runs just call the action.
+     * @param level tracing level.
+     * @param sampleRate with TRACE_SAMPLED, one of every "sampleRate" runs of
+     * each thread is traced.
+     *
+     * @note TRACE_ALL in debug builds, TRACE_SAMPLED(100) otherwise, by default.
+     * Logs of untraced runs carry thread info that their caller has set.
+     */
+    static void set_traceLevel(TraceLevel level, unsigned int sampleRate = 100);
+
+    /**
+     * @brief Returns tracing level of actions.
+     */
+    static TraceLevel get_traceLevel()
+    {
+        return (TraceLevel) traceLevel.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Cache names of module and actions, so that traced runs don't
+     * ask for them again; done by ActionRepository::regActList().
+     */
+    void intern();
+
     /**
      * @brief Run requested user action on command id.
      * @param cmdID command id of requested action.
@@ -103,12 +404,52 @@ public:
      */
     string run(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode, void *data);
 
+    /**
+     * @brief Run requested user action on command id, writing its result
+     * into "writer".
+     * @param cmdID command id of requested action.
+     * @param rnode pointer to root node of parsed xml-formatted command.
+     * @param data associated data with rnode.
+     * @param writer sink of action result.
+     */
+    void stream(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+                void *data, ResponseWriter *writer);
+
+    /**
+     * @brief Start requested asynchronous action on command id; failures
+     * of starting it complete "result" too.
+     * @param cmdID command id of an asynchronous action, as checked by
+     * ActionRepository::startCmd().
+     * @param rnode pointer to root node of parsed xml-formatted command.
+     * @param data associated data with rnode.
+     * @param result completion of action.
+     */
+    void start(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+               void *data, AsyncResult *result);
+
 protected:
     /**
      * @brief Add new action at the end of Actions vector.
      * @param act new action.
+     * @param policy concurrency limit, priority and queue timeout of action.
      */
-    void push_action(FT_action act);
+    void push_action(FT_action act, const ActionPolicy &policy = ActionPolicy());
+
+    /**
+     * @brief Add new streaming action at the end of Actions vector.
+     * @param act new action.
+     * @param policy concurrency limit, priority and queue timeout of action.
+     */
+    void push_action(FT_streamAction act, const ActionPolicy &policy = ActionPolicy());
+
+    /**
+     * @brief Add new asynchronous action at the end of Actions vector.
+     * @param act new action.
+     * @param policy concurrency limit, priority and queue timeout of action;
+     * limits hold until action is complete.
+     */
+    void push_action(FT_asyncAction act, const ActionPolicy &policy = ActionPolicy());
+
     /**
      * @brief Returns module name of owner of this list.
      * @return module name of owner of this list.
@@ -128,10 +469,82 @@ protected:
     virtual string getActionName(XParam::XInt cmdID);
 
 protected:
+    /**
+     * \struct Action
+     * @brief A registered action; just one of its functions is set.
+     */
+    struct Action {
+        FT_action action;
+        FT_streamAction stream;
+        FT_asyncAction async;
+        ActionPolicy policy;
+        /**
+         * @brief Limits running instances, NULL if unlimited.
+         */
+        Gate *gate;
+        /**
+         * @brief Cached getActionName(), set by intern().
+         */
+        string name;
+    };
+
     /**
      * @brief List of Commands.
      */
-    vector<FT_action> Actions;
+    vector<Action> Actions;
+
+private:
+    /**
+     * @brief Whether this run of calling thread would be traced.
+     */
+    static bool traced();
+
+    /**
+     * @brief Traced version of run().
+     */
+    string runTraced(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+                     void *data);
+
+    /**
+     * @brief Traced version of stream().
+     */
+    void streamTraced(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+                      void *data, ResponseWriter *writer);
+
+    /**
+     * @brief Runs an asynchronous action and waits for its result.
+     */
+    static string await(const Action &action, ActionSource::Type st,
+                        const XParam::XmlNode *rnode, void *data);
+
+    /**
+     * @brief Set PLogger thread info of a traced run.
+     */
+    void traceInfo(XParam::XInt cmdID);
+
+private:
+    /**
+     * @brief Cached getModule(), set by intern().
+     */
+    string module;
+
+    /**
+     * @brief Whether names are cached.
+     */
+    bool interned;
+
+    /**
+     * @brief Tracing level and sample rate.
+     */
+    static std::atomic<int> traceLevel;
+    static std::atomic<unsigned int> sampleRate;
+
+    /**
+     * @brief Runs of calling thread, for sampling.
+     */
+    static __thread unsigned int runs;
+
+    friend class ActionRepository;
 };
 
 /**
@@ -145,7 +558,8 @@ public:
      * @brief Initialize Action Repositories environments.
      * @param ssysNO Maximum number of sub-systems.
      *
-     * @note Would be called before any subsystem action list registeration.
+     * @note Would be called once, before any subsystem action list
+     * registeration.
      */
     static void init(XParam::XInt ssysNO);
 
@@ -153,12 +567,21 @@ public:
      * @brief Register an action list for specified sub-system.
      * @param SysID Subsystem ID
      * @param actlist Action list
+     *
+     * @note Safe while commands are running; when it replaces a registered
+     * list, returns after in-flight actions of the old list are finished.
      */
     static void regActList(XParam::XInt SysID, ActionList *actlist);
 
     /**
      * @brief Unregister an action list for specified sub-system.
      * @param SysID Subsystem ID
+     *
+     * @note Safe while commands are running; new commands of sub-system
+     * fail at once, and it returns after in-flight actions of sub-system are
+     * finished, so the action list could be freed then. Would not be called
+     * from an action of the same sub-system. Asynchronous actions are
+     * in-flight until they are complete.
      */
     static void unregActList(XParam::XInt SysID);
 
@@ -168,9 +591,257 @@ public:
      * @param cid command id
      * @param st Action source.
      * @param data associated data with rnode.
+     * @param scope scope of cached results, e.g. token of caller; results
+     * of cacheable actions are shared by identical commands of one scope.
+     *
+     * @note runCmd() doesn't wait for an identical command being run; it
+     * runs the action itself. startCmd() coalesces them.
      */
     static string runCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
-                         const XParam::XmlNode *rnode, void *data);
+                         const XParam::XmlNode *rnode, void *data, const string &scope = "");
+
+    /**
+     * @brief Run the Specified command(cid) in defined sub-system(sid),
+     * writing its result into "writer".
+     * @param sid sub-system id
+     * @param cid command id
+     * @param st Action source.
+     * @param data associated data with rnode.
+     * @param writer sink of action result.
+     * @param scope scope of cached results, as of runCmd().
+     */
+    static void streamCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
+                          const XParam::XmlNode *rnode, void *data, ResponseWriter *writer,
+                          const string &scope = "");
+
+    /**
+     * @brief Start the Specified command(cid) in defined sub-system(sid),
+     * if its action is asynchronous or cacheable; the action completes
+     * "result" later. Limits of action and its lane, and the sub-system
+     * registration, are held until then. A cacheable command identical to
+     * one being run is completed with its result, from the thread that
+     * runs it.
+     * @param sid sub-system id
+     * @param cid command id
+     * @param st Action source.
+     * @param data associated data with rnode.
+     * @param result completion of action.
+     * @param scope Cache key scope of a per-session command.
+     * @return false, doing nothing, when there is no such asynchronous or
+     * cacheable action; throws when command is rejected.
+     */
+    static bool startCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
+                         const XParam::XmlNode *rnode, void *data, AsyncResult *result,
+                         const string &scope = "");
+
+    /**
+     * @brief Whether sid/cid is a registered command; validates ids that
+     * Metrics records (Metrics::set_known()); FireLoop adds its
+     * stats commands.
+     */
+    static bool known(long sid, long cid);
+
+    /**
+     * @brief Returns policy of an action.
+     * @param sid sub-system id
+     * @param cid command id
+     * @param [out] policy policy of action.
+     * @return false if there is no such action.
+     */
+    static bool get_policy(XParam::XInt sid, XParam::XInt cid, ActionPolicy &policy);
+
+    /**
+     * @brief Returns policy of an action, and whether it's asynchronous.
+     */
+    static bool get_policy(XParam::XInt sid, XParam::XInt cid, ActionPolicy &policy,
+                           bool &async);
+
+    /**
+     * @brief Set maximum number of running actions of a priority lane.
+     * @param priority the lane.
+     * @param limit maximum number of running actions, zero if unlimited.
+     *
+     * @note Would be called before any command is run. Limiting the LOW lane
+     * keeps heavy actions from holding all workers.
+     */
+    static void set_laneLimit(ActionPolicy::Priority priority, unsigned int limit);
+
+    /**
+     * @brief Returns snapshot of a priority lane.
+     */
+    static Gate::Stats get_laneStats(ActionPolicy::Priority priority);
+
+    /**
+     * @brief Returns metrics of commands, labelled with names of their
+     * sub-systems and actions.
+     */
+    static vector<Metrics::Record> get_metrics();
+
+    /**
+     * @brief Set maximum number of cached results; 4096 by default.
+     *
+     * @note Would be called before any command is run.
+     */
+    static void set_cacheSize(unsigned int size);
+
+    /**
+     * @brief Returns snapshot of response cache.
+     */
+    static ResponseCache::Stats get_cacheStats();
+
+private:
+    /**
+     * \struct Slot
+     * @brief Registry entry of a sub-system, one cache line each.
+     */
+    struct Slot {
+        /**
+         * @brief Registered action list, NULL if none.
+         */
+        std::atomic<ActionList *> actions;
+
+        /**
+         * @brief Number of commands running on "actions", by parity of the
+         * generation that they pinned slot in.
+         */
+        std::atomic<unsigned long> inflight[2];
+
+        /**
+         * @brief Generation of slot, raised when "actions" is replaced.
+         */
+        std::atomic<unsigned int> generation;
+
+        char padding[64 - sizeof(std::atomic<ActionList *>) -
+                     2 * sizeof(std::atomic<unsigned long>) - sizeof(std::atomic<unsigned int>)];
+    };
+
+    /**
+     * \struct Unpin
+     * @brief Unpins a slot pinned by pin() at end of scope.
+     */
+    struct Unpin {
+        Unpin(std::atomic<unsigned long> *pinned) : pinned(pinned)
+        {
+        }
+
+        ~Unpin()
+        {
+            unpin(pinned);
+        }
+
+        std::atomic<unsigned long> *pinned;
+    };
+
+    /**
+     * \struct Admission
+     * @brief Gates a command has entered, left at end of scope.
+     */
+    struct Admission {
+        Admission() : action(NULL), lane(NULL)
+        {
+        }
+
+        ~Admission()
+        {
+            if (lane != NULL)
+                lane->leave();
+            if (action != NULL)
+                action->leave();
+        }
+
+        Gate *action;
+        Gate *lane;
+    };
+
+    /**
+     * \struct Load
+     * @brief Arguments of a cacheable command, for load().
+     */
+    struct Load {
+        ActionList *actions;
+        XParam::XInt sid;
+        XParam::XInt cid;
+        ActionSource::Type st;
+        const XParam::XmlNode *rnode;
+        void *data;
+    };
+
+    /**
+     * @brief Returns whether result of a command is cached; "rnode" is
+     * needed to identify the command.
+     * @param [out] ttl cache ttl of action.
+     */
+    static bool cacheable(ActionList *actions, XParam::XInt cid, const XParam::XmlNode *rnode,
+                          unsigned int &ttl);
+
+    /**
+     * @brief Traces and throws a dispatch error; dispatch itself isn't
+     * traced, so only failing commands pay for it.
+     * @param logID error.
+     */
+    [[noreturn]] static void fail(ELogID logID);
+
+    /**
+     * @brief Admits and runs a command on a pinned action list, recording
+     * its metrics.
+     */
+    static string execute(ActionList *actions, XParam::XInt sid, XParam::XInt cid,
+                          ActionSource::Type st, const XParam::XmlNode *rnode, void *data);
+
+    /**
+     * @brief Runs a missed cacheable command; load function of "cache".
+     * @param load the Load.
+     */
+    static string load(void *load);
+
+    /**
+     * @brief Completes a command coalesced by startCmd(); ResponseCache
+     * FT_done of an AsyncResult.
+     */
+    static void complete(void *waiter, const string *value, const Exception *error);
+
+    /**
+     * @brief Returns result of a cacheable command, from cache or by
+     * running it; not coalesced with identical commands being run.
+     */
+    static string fetch(ActionList *actions, XParam::XInt sid, XParam::XInt cid,
+                        ActionSource::Type st, const XParam::XmlNode *rnode, void *data,
+                        const string &scope, unsigned int ttl);
+
+    /**
+     * @brief Admits a command by policy of its action; enters the action
+     * gate first, then its lane, without waiting.
+     * @param actions action list of sub-system.
+     * @param cid command id.
+     * @param [out] admission entered gates.
+     * @return false when command is rejected.
+     */
+    static bool admit(ActionList *actions, XParam::XInt cid, Admission &admission);
+
+    /**
+     * @brief Pins action list of a sub-system for running a command.
+     * @param sid sub-system id
+     * @param [out] actions pinned action list.
+     * @return pinned in-flight counter, to be unpinned, or NULL if no
+     * action list is registered.
+     *
+     * @note Wait-free; "inflight" is raised before "actions" is loaded, so
+     * either unregistration waits for this command or it's seen here.
+     */
+    static std::atomic<unsigned long> *pin(XParam::XInt sid, ActionList *&actions);
+
+    /**
+     * @brief Unpins an in-flight counter returned by pin(), waking up a
+     * replacement that waits for it.
+     */
+    static void unpin(std::atomic<unsigned long> *pinned);
+
+    /**
+     * @brief Replaces action list of a slot, and waits for commands running
+     * on the replaced one; serialized by "swapLock".
+     * @return replaced action list.
+     */
+    static ActionList *swap(Slot *slot, ActionList *actions);
 
 private:
     /**
@@ -179,9 +850,40 @@ private:
     static LogSystem log;
 
     /**
-     * @brief List of Actions List of SubSystems.
+     * @brief Action lists of sub-systems, indexed by sub-system id.
+     */
+    static Slot *SSysActions;
+
+    /**
+     * @brief Number of entries in "SSysActions".
      */
-    static vector<ActionList *> SSysActions;
+    static XParam::XInt SSysNO;
+
+    /**
+     * @brief Priority lanes.
+     */
+    static Gate lanes[ActionPolicy::PRIORITIES];
+
+    /**
+     * @brief Results of cacheable actions.
+     */
+    static ResponseCache cache;
+
+    /**
+     * @brief Serializes replacements of action lists.
+     */
+    static pthread_mutex_t swapLock;
+
+    /**
+     * @brief Replacements wait on "drained" for in-flight counters to reach
+     * zero; "draining" is the number of waiting ones, so that unpin() locks
+     * only when someone waits.
+     */
+    static pthread_mutex_t drainLock;
+    static pthread_cond_t drained;
+    static std::atomic<unsigned int> draining;
+
+    friend class AsyncResult;
 };
 
 } // namespace actrepo
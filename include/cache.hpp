@@ -0,0 +1,250 @@
+/**
+ * \file cache.hpp
+ * Response cache of read-only actions.
+ *
+ * Results are kept in a bounded LRU, split into shards by hash of their key,
+ * each shard with its own lock, so lookups of different commands rarely
+ * contend. Identical commands that miss at the same time are coalesced: the
+ * first one runs the action and the others wait for its result
+ * (singleflight), so N callers trigger one execution.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * cache is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+#include <libxml/tree.h>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <putil/cmd.hpp>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace actrepo
+{
+
+/**
+ * \class ResponseCache
+ * @brief Sharded LRU of action results, with coalescing of misses.
+ */
+class ResponseCache
+{
+public:
+    /**
+     * @typedef FT_load
+     * defines the function that produces result of a missed key.
+     * @param context context given to fetch().
+     * @return result, which is cached; a thrown Exception is not cached and
+     * fails coalesced callers too.
+     */
+    typedef std::string (*FT_load)(void *context);
+
+    /**
+     * @typedef FT_done
+     * defines the function that completes a coalesced caller; called by the
+     * caller that loads the result, on its thread, without shard lock.
+     * @param waiter waiter given to fetch().
+     * @param result loaded result, NULL when load is failed.
+     * @param error failure of load, NULL on success.
+     */
+    typedef void (*FT_done)(void *waiter, const std::string *result,
+                            const putil::Exception *error);
+
+    /**
+     * \struct Stats
+     * @brief Snapshot of cache state.
+     */
+    struct Stats {
+        unsigned long entries;
+        unsigned long long hits;
+        unsigned long long misses;
+
+        /**
+         * @brief Callers completed by the load of an identical command.
+         */
+        unsigned long long coalesced;
+    };
+
+    /**
+     * @brief ResponseCache constructor.
+     * @param capacity maximum number of cached results.
+     */
+    ResponseCache(unsigned int capacity = 4096);
+
+    ~ResponseCache();
+
+    /**
+     * @brief Change maximum number of cached results.
+     *
+     * @note Would be called before any command is run.
+     */
+    void set_capacity(unsigned int capacity);
+
+    /**
+     * @brief Returns cached result of key, or loads it. No caller waits for
+     * the load of another one: given a "done" function, a caller whose key
+     * is being loaded is queued, and completed by the loading caller;
+     * without one, it loads the result itself.
+     * @param key key of result, as built by key().
+     * @param ttl milli seconds that a loaded result is served.
+     * @param load function that produces result on a miss.
+     * @param context argument of "load".
+     * @param done completes a coalesced caller, NULL if caller can't be
+     * completed later.
+     * @param waiter argument of "done".
+     * @param [out] result result of key, unless caller is coalesced.
+     * @param [out] hit whether result is served without calling "load".
+     * @return false when caller is coalesced; "done" is called later.
+     */
+    bool fetch(const std::string &key, unsigned int ttl, FT_load load, void *context,
+               FT_done done, void *waiter, std::string &result, bool &hit);
+
+    /**
+     * @brief Drop all cached results.
+     */
+    void clear();
+
+    /**
+     * @brief Returns snapshot of cache state.
+     */
+    Stats get_stats();
+
+    /**
+     * @brief Builds key of a command: its ids, a scope (e.g. caller token)
+     * and canonical form of its tree, in which attributes are sorted and
+     * whitespace-only text between elements is dropped, so that equivalent
+     * commands share a key; text of parameters is kept as it is.
+     * @param [out] key built key.
+     */
+    static void key(std::string &key, long sid, long cid, const std::string &scope,
+                    const putil::XParam::XmlNode *rnode);
+
+private:
+    /**
+     * \struct Entry
+     * @brief A cached result.
+     */
+    struct Entry {
+        std::string key;
+        std::string result;
+
+        /**
+         * @brief Time (Metrics::now()) that result expires.
+         */
+        unsigned long long expires;
+    };
+
+    /**
+     * \struct Flight
+     * @brief A load in progress, and its coalesced callers.
+     */
+    struct Flight {
+        /**
+         * @brief Callers to complete when load is done, oldest first.
+         */
+        std::vector<std::pair<FT_done, void *> > waiters;
+    };
+
+    typedef std::list<Entry> Entries;
+
+    /**
+     * \struct Shard
+     * @brief A part of cache, one lock each.
+     */
+    struct Shard {
+        pthread_mutex_t mutex;
+
+        /**
+         * @brief Cached results, most recently used first.
+         */
+        Entries entries;
+        std::unordered_map<std::string, Entries::iterator> index;
+
+        /**
+         * @brief Loads in progress, by key.
+         */
+        std::unordered_map<std::string, Flight> flights;
+
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long coalesced;
+
+        /**
+         * @brief Pads shard to a multiple of cache line, so that locks of
+         * shards don't share lines.
+         */
+        char padding[64 - (sizeof(pthread_mutex_t) + sizeof(Entries) +
+                           sizeof(std::unordered_map<std::string, Entries::iterator>) +
+                           sizeof(std::unordered_map<std::string, Flight>) +
+                           3 * sizeof(unsigned long long)) % 64];
+    };
+
+    static_assert(sizeof(Shard) % 64 == 0, "Shard must fill whole cache lines");
+
+    /**
+     * @brief Returns shard of a key.
+     */
+    Shard &shard(const std::string &key);
+
+    /**
+     * @brief Stores a loaded result, evicting least recently used ones
+     * beyond capacity; called with shard lock.
+     */
+    void store(Shard &shard, const std::string &key, const std::string &result,
+               unsigned long long expires);
+
+    /**
+     * @brief Ends the load of a key: stores its result, if loaded, and
+     * completes its coalesced callers.
+     * @param result loaded result, NULL when load is failed.
+     * @param error failure of load, NULL on success.
+     */
+    void land(Shard &shard, const std::string &key, unsigned int ttl, const std::string *result,
+              const putil::Exception *error);
+
+    /**
+     * @brief Appends canonical form of a node and its descendants.
+     */
+    static void canonicalize(std::string &out, const _xmlNode *node);
+
+    /**
+     * @brief Whether a character isn't whitespace.
+     */
+    static bool notSpace(char c);
+
+private:
+    /**
+     * @brief Number of shards.
+     */
+    static const unsigned int SHARDS = 16;
+
+    Shard shards[SHARDS];
+
+    /**
+     * @brief Maximum number of results per shard.
+     */
+    unsigned int shardCapacity;
+};
+
+} // namespace actrepo
@@ -30,18 +30,315 @@
 #pragma once
 
 #include "actrepo.hpp"
+#include "freelist.hpp"
+#include "reactor.hpp"
+#include "tracer.hpp"
+#include "workerpool.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <fcntl.h>
+#include <future>
 #include <ipc/socket-client.hpp>
 #include <ipc/socket-server.hpp>
-#include <putil/epoll.hpp>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/uio.h>
 
 using namespace ipc::net;
 
 namespace actrepo
 {
+struct Session;
+
+/**
+ * \struct FrameHeader
+ * @brief Parsed header of a framed command.
+ */
+struct FrameHeader {
+    /**
+     * @brief Length of command.
+     */
+    unsigned long length;
+
+    /**
+     * @brief Request id of command (option "t"), empty when untagged.
+     */
+    string tag;
+
+    /**
+     * @brief Keep connection open after response (option "k").
+     */
+    bool keepAlive;
+
+    /**
+     * @brief User accepts chunked response (option "c").
+     */
+    bool chunked;
+
+    /**
+     * @brief Command is in binary envelope (magic prefix).
+     */
+    bool binary;
+};
+
+/**
+ * \struct Counters
+ * @brief Traffic counters of a reactor and its connections, two cache lines
+ * per reactor; the array of them is cache line aligned (FireLoop::loop()),
+ * so reactors don't share lines.
+ */
+struct Counters {
+    /**
+     * @brief Open connections.
+     */
+    std::atomic<long> connections;
+
+    /**
+     * @brief Commands handed to workers and not completed yet.
+     */
+    std::atomic<long> sessions;
+
+    /**
+     * @brief Accepted connections since start.
+     */
+    std::atomic<unsigned long long> accepted;
+
+    /**
+     * @brief Bytes read from and sent to users.
+     */
+    std::atomic<unsigned long long> bytesIn;
+    std::atomic<unsigned long long> bytesOut;
+
+    /**
+     * @brief Bad frame headers, and commands that couldn't be parsed.
+     */
+    std::atomic<unsigned long long> frameErrors;
+    std::atomic<unsigned long long> parseErrors;
+
+    /**
+     * @brief Bytes of admitted commands not completed yet.
+     */
+    std::atomic<long> bytesInflight;
+
+    /**
+     * @brief Connections and commands shed by admission limits, by the
+     * limit that shed them; "shedQueued" counts commands rejected by a full
+     * workers queue too.
+     */
+    std::atomic<unsigned long long> shedConnections;
+    std::atomic<unsigned long long> shedSessions;
+    std::atomic<unsigned long long> shedBytes;
+    std::atomic<unsigned long long> shedQueued;
+
+    /**
+     * @brief Connections closed as their request missed a deadline.
+     */
+    std::atomic<unsigned long long> timeouts;
+
+    char padding[2 * 64 - 3 * sizeof(std::atomic<long>) -
+                 10 * sizeof(std::atomic<unsigned long long>)];
+};
+
+static_assert(sizeof(Counters) == 2 * 64, "Counters must fill two cache lines");
+
+/**
+ * \struct Connection.
+ * @brief Defines a connection between user and pvm, which carries one or
+ * more framed commands.
+ *
+ * @note Except output members guarded by "writeLock", connection is only
+ * touched on its reactor thread.
+ * @note Connections are reused through free list of their reactor (Pools);
+ * open() prepares a new or released one for an accepted socket.
+ */
+struct Connection {
+    /**
+     * @brief Part of a request that connection waits for; deadlines apply
+     * to header and body.
+     */
+    enum Phase
+    {
+        IDLE,
+        HEADER,
+        BODY
+    };
+
+    Connection();
+
+    ~Connection();
+
+    /**
+     * @brief Prepare connection for an accepted socket, whose peer address
+     * is in "address".
+     * @param sfd connection FD.
+     * @param bufSize size of receive buffer.
+     */
+    void open(int sfd, unsigned int bufSize);
+
+    /**
+     * @brief Peer address, filled by accept.
+     */
+    struct sockaddr_storage address;
+
+    /**
+     * @brief Socket file descriptor of opened connection by user.
+     */
+    int socket_fd;
+
+    /**
+     * @brief IP.
+     */
+    string ip;
+
+    /**
+     * @brief Port.
+     */
+    int port;
+
+    /**
+     * @brief Reactor that reads the connection socket.
+     */
+    Reactor *reactor;
+
+    /**
+     * @brief Counters of reactor.
+     */
+    Counters *counters;
+
+    /**
+     * @brief Times (Metrics::now()) that connection is accepted, and that
+     * first byte of the frame at the beginning of input is read.
+     */
+    unsigned long long accepted;
+    unsigned long long firstByte;
+
+    /**
+     * @brief Connection socket as watched by reactor.
+     */
+    Reactor::Watch watch;
+
+    /**
+     * @brief Events that socket is armed for, zero when disarmed.
+     */
+    unsigned int armedEvents;
+
+    /**
+     * @brief A complete command waits for commands in flight, so nothing
+     * more is read.
+     */
+    bool blocked;
+
+    /**
+     * @brief Receive buffer of frame headers (and small commands); its size
+     * is FireLoop "bufSize".
+     */
+    vector<char> input;
+
+    /**
+     * @brief Bytes of "input" not framed yet are [inputBegin, inputEnd).
+     */
+    unsigned int inputBegin;
+    unsigned int inputEnd;
+
+    /**
+     * @brief Session whose command body is being read straight into its
+     * "_xml_cmd", bypassing "input"; NULL when reading frame headers.
+     */
+    Session *reading;
+
+    /**
+     * @brief Bytes of "reading" command received so far.
+     */
+    unsigned long received;
+
+    /**
+     * @brief Bytes of body of a shed command still to be skipped.
+     */
+    unsigned long discard;
+
+    /**
+     * @brief Phase of request being read, and deadline (Metrics::now()) of
+     * the whole request, zero when disabled.
+     */
+    Phase phase;
+    unsigned long long requestDeadline;
+
+    /**
+     * @brief Fires when request misses its deadline.
+     */
+    Reactor::Timer timer;
+
+    /**
+     * @brief Keep connection open after responses (frame option "k").
+     */
+    bool keepAlive;
+
+    /**
+     * @brief User has closed its side or has sent a bad frame; nothing more
+     * would be read.
+     */
+    bool closing;
+
+    /**
+     * @brief Number of commands handed over to workers and not completed.
+     */
+    unsigned int inflight;
+
+    /**
+     * @brief An untagged command is in flight; following commands wait
+     * for it, so untagged responses are sent in order.
+     */
+    bool ordered;
+
+    /**
+     * @brief Serializes responses written by workers and reactor.
+     */
+    pthread_mutex_t writeLock;
+
+    /**
+     * @brief Responses that socket couldn't take yet; reactor sends them
+     * when socket is writable.
+     */
+    std::deque<string> output;
+
+    /**
+     * @brief Bytes of first "output" entry already sent.
+     */
+    size_t outputOffset;
+
+    /**
+     * @brief Total bytes of "output" not sent yet.
+     */
+    size_t outputBytes;
+
+    /**
+     * @brief Signaled when reactor sends queued output.
+     */
+    pthread_cond_t drained;
+
+    /**
+     * @brief Writing to socket failed; nothing more would be sent.
+     */
+    bool broken;
+
+    /**
+     * @brief Number of watchOutput() tasks posted and not run yet, guarded
+     * by "writeLock"; a released connection isn't reused until they run.
+     */
+    unsigned int posted;
+
+    /**
+     * @brief Connection is closed and released; posted tasks ignore it.
+     */
+    bool released;
+};
+
 /**
  * \struct Session.
- * @brief Defines a session between user and pvm.
+ * @brief Defines a session between user and pvm, for one command.
  */
 struct Session {
     /**
@@ -53,10 +350,29 @@ struct Session {
     /**
      * @brief Session constructor.
      * @param sfd sesstion FD.
-     * @param _socketAddress socket address.
+     * @param _socketAddress socket address, which is copied.
      */
     Session(int sfd, struct sockaddr *_socketAddress);
 
+    /**
+     * @brief Session constructor.
+     * @param _connection connection that carries the command.
+     */
+    Session(Connection *_connection);
+
+    /**
+     * @brief Session constructor, of sessions in free lists; reset()
+     * prepares them for a command.
+     */
+    Session();
+
+    /**
+     * @brief Prepare a new or released session for a command, keeping its
+     * buffers.
+     * @param _connection connection that carries the command.
+     */
+    void reset(Connection *_connection);
+
     /**
      * @brief Responses to client and then closes the client connection
      */
@@ -71,7 +387,7 @@ struct Session {
     /**
      * @brief socket address.
      */
-    struct sockaddr *socketAddress;
+    struct sockaddr_storage socketAddress;
 
     /**
      * @brief IP.
@@ -102,6 +418,95 @@ struct Session {
      * @brief Session's token.
      */
     std::string token;
+
+    /**
+     * @brief Connection that carries the command.
+     */
+    Connection *connection;
+
+    /**
+     * @brief Request id of command (frame option "t"), echoed in response;
+     * empty for untagged commands.
+     */
+    string tag;
+
+    /**
+     * @brief User accepts chunked response (frame option "c").
+     */
+    bool chunked;
+
+    /**
+     * @brief Sub-system and command ids, -1 until command is parsed.
+     */
+    long sid;
+    long cid;
+
+    /**
+     * @brief Times (Metrics::now()) that frame header is parsed and that
+     * command is queued to workers.
+     */
+    unsigned long long started;
+    unsigned long long queued;
+
+    /**
+     * @brief Time that first byte of command is read.
+     */
+    unsigned long long firstByte;
+
+    /**
+     * @brief Command is in binary envelope.
+     */
+    bool binary;
+
+    /**
+     * @brief Payload of command, within "_xml_cmd": the whole command for
+     * xml commands, what follows the envelope header for binary ones.
+     * Actions that don't get a parsed tree could read it through session.
+     */
+    const char *payload;
+    size_t payloadLength;
+
+    /**
+     * @brief Routing of command, found on reactor before it's queued: one of
+     * FireLoop::PRESCAN_*, -1 until then, and whether payload is an xml
+     * command.
+     */
+    int routing;
+    bool xml;
+
+    /**
+     * @brief Priority of action of command; selects its workers queue.
+     */
+    ActionPolicy::Priority priority;
+};
+
+/**
+ * \struct Pools
+ * @brief Released connections and sessions of a reactor, reused by its new
+ * ones; only touched on reactor thread.
+ */
+struct Pools {
+    Pools() : connections(1024), sessions(256)
+    {
+    }
+
+    FreeList<Connection> connections;
+    FreeList<Session> sessions;
+};
+
+/**
+ * \struct Backlog
+ * @brief Commands of a reactor parked while workers queue is full, retried
+ * as workers complete commands and on each tick of "timer"; only touched on
+ * reactor thread.
+ */
+struct Backlog {
+    /**
+     * @brief Parked sessions by priority, oldest first.
+     */
+    std::deque<Session *> sessions[ActionPolicy::PRIORITIES];
+
+    Reactor::Timer timer;
 };
 
 /**
@@ -138,6 +543,33 @@ public:
     string get_description();
     void set_description(const string _description);
 
+    /**
+     * @brief Appends xml of a response to "out", without building a
+     * Response; output is byte-identical to xml() of such a response.
+     * @param [out] out string that xml is appended to.
+     * @param _status status of response.
+     * @param _description description of response.
+     *
+     * @note The envelope around description, and how each character of
+     * description is escaped, are learned once from xml() of probe responses.
+     * Descriptions with characters that couldn't be learned (non-ASCII or
+     * NUL) take the generic xml() path.
+     */
+    static void serialize(string &out, const int _status, const string &_description);
+
+private:
+    /**
+     * @brief Learns envelope and escaping of xml() for serialize().
+     */
+    static void learn();
+
+    /**
+     * @brief Appends xml of a response using learned envelope and escaping.
+     * @return false, leaving "out" untouched, when description has a
+     * character that is not learned.
+     */
+    static bool escape(string &out, const int _status, const string &_description);
+
 private:
     /**
      * @brief Status of response.
@@ -148,11 +580,78 @@ private:
      * @brief Description of response.
      */
     XTextParam description;
+
+    /**
+     * @brief Guards learn().
+     */
+    static pthread_once_t learned;
+
+    /**
+     * @brief Whether serialize() could use learned envelope.
+     */
+    static bool fastPath;
+
+    /**
+     * @brief xml() of responses, before and after description, per status.
+     */
+    static string head[ResponseStatus::MAX];
+    static string tail[ResponseStatus::MAX];
+
+    /**
+     * @brief xml() of responses with empty description, per status.
+     */
+    static string empty[ResponseStatus::MAX];
+
+    /**
+     * @brief Escaped form of each ASCII character in description.
+     */
+    static string escaped[128];
+
+    /**
+     * @brief Whether escaped form of character is learned.
+     */
+    static bool known[128];
+
+    /**
+     * @brief Whether character is written as is in description.
+     */
+    static bool verbatim[128];
 };
 
 /**
  * \class FireLoop
  * @brief Manages process loop of user commands.
+ *
+ * Commands are framed as "length[;option]...:command", where options are:
+ * - "k": keep connection open after response, so that more commands could
+ *   be sent (pipelined) over it. Untagged commands are run one after
+ *   another and their responses are sent in order.
+ * - "tID": tag command with request id "ID" (up to 32 of [A-Za-z0-9_-]).
+ *   Tagged commands of a connection may run concurrently and their
+ *   responses, framed as "length;tID:response", may arrive out of order.
+ * - "c": user accepts chunked response. Result of streaming actions is then
+ *   sent in "length;c[;tID]:data" frames as it is produced, followed by the
+ *   usual response frame, whose description is empty on success; the result
+ *   is the concatenation of chunks.
+ *
+ * Without "k" the connection is closed after the first response, as before.
+ *
+ * A frame prefixed by BINARY_MAGIC ("PVB1length[;option]...:command")
+ * carries a binary envelope instead of xml, for high-rate internal callers;
+ * command is then, in network byte order:
+ * - sid (int32), cid (int32), flags (uint16), token length (uint16),
+ * - token, then payload up to the end of frame.
+ * It's routed without any text parsing. With flag BINARY_XML, payload is an
+ * xml command, parsed for actions that read the tree; otherwise it's raw
+ * bytes and actions get a NULL tree. Responses are framed as usual.
+ *
+ * Asynchronous actions leave their worker once started; their response is
+ * sent by the reactor when they are complete, as one chunk for users that
+ * accept chunked responses.
+ *
+ * When enabled (set_statsEnabled()), commands of system id get_statsSysID()
+ * are served by FireLoop itself, without any sub-system; cid STATS_SUMMARY
+ * returns get_stats() and STATS_TRACES returns get_traces().
  */
 class FireLoop
 {
@@ -171,7 +670,8 @@ public:
     static void set_ip(const string _ip);
     /**
      * Get/Set the port number
-     * \param Port number to listen on
+     * \param Port number to listen on; zero picks a free port, which
+     * get_port() returns once loop() is listening.
      */
     static int get_port();
     static void set_port(const int _port);
@@ -183,47 +683,328 @@ public:
     static void set_unixSocket(string path);
     /**
      * Set Size of Communication buffer with user.
+     * Frame headers and commands smaller than buffer are read through it;
+     * larger commands are read straight into their final storage.
      */
     static void set_bufSize(unsigned int size);
+    /**
+     * Set maximum length of a command, 16 MB by default; frames of longer
+     * commands are answered as bad frames. Body of a command is stored as
+     * it arrives, never allocated up front for its announced length.
+     */
+    static void set_maxCommand(unsigned long length);
+    /**
+     * Set number of worker threads that run user commands.
+     */
+    static void set_workers(unsigned int number);
+    /**
+     * Set capacity of the queue of sessions waiting for a worker.
+     */
+    static void set_queueSize(unsigned int size);
+    /**
+     * Set how long (milli seconds) a command waits, parked on its reactor,
+     * when the queue is full, before it's rejected; zero rejects at once.
+     */
+    static void set_queueTimeout(unsigned int timeout);
+    /**
+     * Set number of reactors that accept connections and read commands.
+     * With more than one, each reactor runs in its own thread pinned to a
+     * core, and has its own SO_REUSEPORT TCP listener.
+     */
+    static void set_reactors(unsigned int number);
+    /**
+     * Set admission limits; past them, a command is answered at once with
+     * a precomputed "Server is busy" failure, without reading its body nor
+     * queuing it, and a new connection is answered so and closed. Zero,
+     * the default, disables a limit.
+     * - connections: open connections.
+     * - sessions: commands handed to workers and not completed.
+     * - bytes: bytes of commands in flight, with the one being admitted.
+     * - queued: commands waiting for a worker.
+     */
+    static void set_maxConnections(unsigned int number);
+    static void set_maxSessions(unsigned int number);
+    static void set_maxBytes(unsigned long bytes);
+    static void set_maxQueued(unsigned int number);
+    /**
+     * Set deadlines (milli seconds) of reading a command: its frame header,
+     * from first byte or from accept; its body, from header; and both, as
+     * a whole. A connection whose command misses a deadline is closed, so
+     * that slow or stalled clients can't hold it. Zero disables a deadline.
+     */
+    static void set_headerTimeout(unsigned int timeout);
+    static void set_bodyTimeout(unsigned int timeout);
+    static void set_requestTimeout(unsigned int timeout);
+    /**
+     * Returns queue depth, wait time and other statistics of workers.
+     */
+    static WorkerPool::Stats get_poolStats();
+    /**
+     * Get/Set system id of the stats command, served by FireLoop itself;
+     * -1 by default, which is never a sub-system.
+     */
+    static XParam::XInt get_statsSysID();
+    static void set_statsSysID(XParam::XInt sysID);
+    /**
+     * Enable or disable the stats command; disabled by default. Stats are
+     * served to any user that can reach the sockets, without authorization,
+     * at HIGH priority and past admission limits of actions, so deployments
+     * enable it only where every user may read them.
+     */
+    static void set_statsEnabled(bool enable);
+    /**
+     * Returns live server state as xml: connections, sessions, traffic,
+     * errors, workers and lanes queues, response cache, and latency
+     * percentiles of actions.
+     * It's the response of stats command (cid STATS_SUMMARY).
+     */
+    static string get_stats();
+    /**
+     * Returns timelines of sampled requests (Tracer) as xml, oldest first;
+     * times are nano seconds from first byte of request.
+     * It's the response of stats command STATS_TRACES.
+     */
+    static string get_traces();
+    /**
+     * Set names of child elements of command that carry system id, command
+     * id and token; commands are routed by a pre-scan of these elements,
+     * without parsing the whole command. Commands that the pre-scan can't
+     * route are parsed as before.
+     */
+    static void set_routingTags(const string sysID, const string cmdID, const string token);
+    /**
+     * @brief Run a command of a co-located sub-system on workers, without
+     * sockets, framing nor xml round-trips; with the same limits and
+     * metrics as commands of users.
+     * @param sid sub-system id.
+     * @param cid command id.
+     * @param source caller of action.
+     * @param rnode prebuilt command tree; must live until result is ready.
+     * @param token token of command.
+     * @return result of action; its get() throws what the action throws,
+     * or an Exception when the command is shed by admission limits, workers
+     * queue is full or it waited longer than queue timeout of its action.
+     * Caller never waits for room.
+     */
+    static std::future<string> submit(XParam::XInt sid, XParam::XInt cid,
+                                      ActionSource::Type source, const XParam::XmlNode *rnode,
+                                      const string &token = "");
+
+    /**
+     * @brief Run a command of a co-located sub-system on workers, like the
+     * above; the command is given as a payload.
+     * @param payload command payload, which actions could read through
+     * Session::payload.
+     * @param xml whether payload is an xml command; it's then parsed on the
+     * worker for actions that read the tree.
+     */
+    static std::future<string> submit(XParam::XInt sid, XParam::XInt cid,
+                                      ActionSource::Type source, const string &payload, bool xml,
+                                      const string &token = "");
+
     /**
      * @brief Listen to the unix socket and read user XML-formatted command.
      *
-     * @note This method loops over user commands and calls fire() for
+     * @note This method runs the reactor that accepts connections and reads
+     * user commands, and hands each complete command to fire() for
      * calling apprpriate action based on user command.
      */
     static void loop();
 
+    /**
+     * @brief Parses frame header in place, at the beginning of input,
+     * as reactors frame commands of users.
+     * @param input unframed input of connection.
+     * @param size size of input.
+     * @param [out] frame parsed header.
+     * @return length of frame header, zero when header is incomplete or -1
+     * when header is bad or command is longer than "maxCommand".
+     */
+    static int parseFrame(const char *input, size_t size, FrameHeader &frame);
+
 private:
     /**
      * @brief Accepts new connection.
-     * @param epollData polling data associated with socket.
-     * @param data Session's necessary data.
+     * @param reactor reactor that watches listening socket.
+     * @param events ready events of listening socket.
+     * @param data listener watch.
+     */
+    static void acceptSocket(Reactor *reactor, unsigned int events, void *data);
+
+    /**
+     * @brief Frames commands from connection input and hands them over to
+     * workers, as long as ordering of connection allows, on reactor thread.
+     * Then re-arms reading or closes connection.
+     * @param connection user's connection.
+     */
+    static void dispatch(Connection *connection);
+
+    /**
+     * @brief Hands a complete command over to workers queue of its priority.
+     * @param session command session.
+     */
+    static void schedule(Session *session);
+
+    /**
+     * @brief Finds routing, payload and priority of a complete command on
+     * reactor, so it's queued by priority before it reaches a worker.
+     * @param session command session.
+     */
+    static void route(Session *session);
+
+    /**
+     * @brief Hands parked commands of a reactor over to workers, highest
+     * priority first, as long as workers queues have room, and rejects the
+     * ones parked for longer than "queueTimeout"; task of backlog timer.
+     */
+    static void retry(Reactor *reactor, void *data);
+
+    /**
+     * @brief Answers a command that workers can't take with the busy
+     * response, and completes it.
+     */
+    static void reject(Session *session);
+
+    /**
+     * @brief Whether a new command is admitted under admission limits;
+     * shed ones are counted by the limit that sheds them.
+     * @param counters counters of reactor of command; in-process calls are
+     * counted on the first reactor.
+     * @param length length of command.
+     */
+    static bool admit(Counters *counters, unsigned long length);
+
+    /**
+     * @brief Arms deadline timer of connection for the phase of request
+     * being read now, or cancels it; on reactor thread.
+     * @param connection user's connection.
+     * @param framed whether a frame is taken from input since last call, so
+     * that a new request is being read.
+     */
+    static void armDeadline(Connection *connection, bool framed);
+
+    /**
+     * @brief Timer task of a connection whose request missed its deadline;
+     * closes connection.
+     * @param data connection.
+     */
+    static void expire(Reactor *reactor, void *data);
+
+    /**
+     * @brief Returns sum of a counter over reactors.
+     */
+    static long total(std::atomic<long> Counters::*counter);
+
+    /**
+     * @brief Answers a shed or rejected command with the precomputed busy
+     * response.
+     * @param connection connection that carries the command.
+     * @param tag request id of command.
+     */
+    static void writeBusy(Connection *connection, const string &tag);
+
+    /**
+     * @brief Arms connection socket for the events it needs now: reading,
+     * unless it is closing or blocked, and writing, when output is queued.
+     * @param connection user's connection.
+     * @return false when connection is closed.
+     */
+    static bool rearm(Connection *connection);
+
+    /**
+     * @brief Sends queued output of connection, on reactor thread.
+     * @param connection user's connection.
+     * @return whether output is still pending.
+     */
+    static bool flushOutput(Connection *connection);
+
+    /**
+     * @brief Arms connection socket for writing, posted by writeResponse();
+     * ignores a connection released meanwhile, and puts it back to free list
+     * if it's the last posted task.
+     * @param reactor reactor of connection.
+     * @param data user's connection.
+     */
+    static void watchOutput(Reactor *reactor, void *data);
+
+    /**
+     * @brief Completes a command on reactor thread, posted by fire().
+     * @param reactor reactor of command connection.
+     * @param data command session.
      */
-    static void acceptSocket(EPoll::Data *epollData, void *data);
+    static void complete(Reactor *reactor, void *data);
 
     /**
      * @brief Call appropriate action base on user command.
      * @param session user 's session information.
      *
-     * @note Each fire would be run in a seprate thread.
-     * fire() is thread function.
-     * @note Threads would be created by this * function to response to user requests.
+     * @note Each fire would be run by one of the workers.
+     * fire() is job function of worker pool.
      */
-    static void *fire(void *session);
+    static void fire(void *session);
 
     /**
-     * @brief Sends failure message.
+     * @brief Sends failure message, then completes the session.
      * @param session User's session.
      * @param message Message.
+     *
+     * @note Would be called on reactor thread.
      */
     static void fire_failed(Session *session, const string message);
 
     /**
-     * @brief Handles proxy operations.
-     * @param epollData polling data associated with socket.
-     * @param data Session's necessary data.
+     * @brief Reads framed commands of connection, on reactor thread.
+     * @param reactor reactor that watches connection socket.
+     * @param events ready events of connection socket.
+     * @param data user's connection.
+     *
+     * @note Connection socket is watched one-shot, so it is disarmed while
+     * commands wait for workers.
+     */
+    static void processSocket(Reactor *reactor, unsigned int events, void *data);
+
+    /**
+     * @brief Opens a TCP listener on ip:port with SO_REUSEPORT, so that
+     * each reactor has its own listener and kernel balances connections.
+     * @return listener file descriptor.
+     */
+    static int listenReusePort();
+
+    /**
+     * @brief Returns port that a TCP listener is bound to.
+     * @param listener listener file descriptor.
+     */
+    static int localPort(int listener);
+
+    /**
+     * @brief Thread function of reactors, pinned to a core.
+     * @param index index of reactor in "reactors".
+     */
+    static void *runReactor(void *index);
+
+    /**
+     * @brief Closes connection socket and releases connection.
+     * @param connection User's connection.
+     */
+    static void closeConnection(Connection *connection);
+
+    /**
+     * @brief Returns a session for a command of connection, from free list
+     * of its reactor; throws std::bad_alloc.
+     */
+    static Session *newSession(Connection *connection);
+
+    /**
+     * @brief Puts a session, if not NULL, back to free list of its
+     * reactor, on reactor thread; buffers of large commands are not kept.
+     */
+    static void release(Session *session);
+
+    /**
+     * @brief Puts a closed connection back to free list of its reactor,
+     * once no posted task refers to it.
      */
-    static void processSocket(EPoll::Data *epollData, void *data);
+    static void release(Connection *connection);
 
     /**
      * @brief Send appropraite message to user when action excution
@@ -239,14 +1020,211 @@ private:
      */
     static void answer_failed(const Session *session, const Exception &e);
 
+    /**
+     * @brief Serialize response and send it to user, recording serialize
+     * and write phases of command.
+     * @param status status of response.
+     * @param des description of response.
+     */
+    static void respond(const Session *session, int status, const string &des);
+
+    /**
+     * \struct Call
+     * @brief An in-process command, from submit() until it's run.
+     */
+    struct Call {
+        Call(XParam::XInt sid, XParam::XInt cid, ActionSource::Type source, const string &token)
+            : session(token), source(source), rnode(NULL), xml(false)
+        {
+            session.sid = sid;
+            session.cid = cid;
+        }
+
+        /**
+         * @brief Session passed to action as its data; has no connection.
+         */
+        Session session;
+
+        ActionSource::Type source;
+        const XParam::XmlNode *rnode;
+        string payload;
+        bool xml;
+        std::promise<string> result;
+    };
+
+    /**
+     * @brief Hands a call over to workers queue of its priority, under the
+     * admission limits of commands of users, without waiting.
+     */
+    static std::future<string> submit(Call *call);
+
+    /**
+     * @brief Completes a call with the busy error, and deletes it.
+     */
+    static void busy(Call *call);
+
+    /**
+     * @brief Runs an in-process command, on a worker thread.
+     * @param call the Call.
+     */
+    static void runCall(void *call);
+
+    /**
+     * \struct Worker
+     * @brief Objects of a worker thread, reused by its commands.
+     */
+    struct Worker {
+        /**
+         * @brief Parser of commands; parsing a command replaces tree of
+         * the previous one.
+         */
+        XParam::XmlParser *parser;
+    };
+
+    /**
+     * @brief Returns objects of calling worker thread, creating them at
+     * first call.
+     */
+    static Worker *get_worker();
+
+    /**
+     * @brief Creates "workerKey", once.
+     */
+    static void createWorkerKey();
+
+    /**
+     * @brief Frees objects of an exiting worker thread.
+     */
+    static void destroyWorker(void *worker);
+
+    /**
+     * @brief Results of prescan().
+     */
+    enum
+    {
+        PRESCAN_ROUTED,    /**< Routing elements are found */
+        PRESCAN_UNKNOWN,   /**< Command needs a full parse */
+        PRESCAN_MALFORMED, /**< Command is not well-formed xml */
+    };
+
+    /**
+     * @brief Extracts routing elements (set_routingTags()), children of
+     * root element, from command text without building a tree.
+     * @param command xml command.
+     * @param [out] sid system id.
+     * @param [out] cid command id.
+     * @param [out] token token.
+     * @return one of PRESCAN_*.
+     */
+    static int prescan(const string &command, long &sid, long &cid, string &token);
+
+    /**
+     * @brief Size of fixed part of binary envelope header.
+     */
+    static const size_t BINARY_HEADER = 12;
+
+    /**
+     * @brief Decodes binary envelope of command into session routing and
+     * payload.
+     * @param [out] xml whether payload is an xml command.
+     * @return false when envelope is malformed.
+     */
+    static bool decodeBinary(Session *session, bool &xml);
+
+    /**
+     * @brief Runs a command of stats system id.
+     * @param cid command id.
+     * @return response of command.
+     */
+    static string runStats(XParam::XInt cid);
+
+    /**
+     * @brief Whether sid/cid is a stats command or a registered one;
+     * validates ids that Metrics records (Metrics::set_known()).
+     */
+    static bool known(long sid, long cid);
+
+    /**
+     * @brief Appends name="value" to "out".
+     */
+    static void attribute(string &out, const char *name, unsigned long long value);
+    static void attribute(string &out, const char *name, const string &value);
+
     /**
      * @brief Sends message to peer.
      * @param session User's session.
-     * @param message Message.
+     * @param response Message; its content may be taken over.
+     *
+     * @note Header and response are sent with one vectored write, without
+     * building a framed copy. What socket can't take now is queued on
+     * connection and sent by reactor.
+     */
+    static void writeResponse(const Session *session, string &response);
+
+    /**
+     * @brief Sends a frame to peer.
+     * @param session User's session.
+     * @param payload Frame payload; its content may be taken over.
+     * @param chunk whether frame is a chunk of response.
+     */
+    static void writeFrame(const Session *session, string &payload, bool chunk);
+
+    /**
+     * @brief Sends a frame of a command to peer, like the above.
+     * @param connection connection that carries the command.
+     * @param tag request id of command.
+     */
+    static void writeFrame(Connection *connection, const string &tag, string &payload,
+                           bool chunk);
+
+    /**
+     * \class ChunkWriter
+     * @brief Sends result of streaming actions in chunk frames.
+     */
+    class ChunkWriter;
+
+    /**
+     * \class Pending
+     * @brief Completion of an asynchronous action of a session; resumes
+     * the session on its reactor.
+     */
+    class Pending;
+
+    /**
+     * @brief Answers a session whose asynchronous action is complete, then
+     * completes it, on reactor thread.
+     * @param reactor reactor of command connection.
+     * @param data the Pending.
      */
-    static void writeResponse(const Session *session, const string response);
+    static void resume(Reactor *reactor, void *data);
 
 private:
+    /**
+     * @brief Maximum length of a frame header.
+     */
+    static const unsigned int MAX_HEADER = 64;
+
+    /**
+     * @brief Maximum tagged commands of a connection in flight.
+     */
+    static const unsigned int MAX_PIPELINE = 64;
+
+    /**
+     * @brief Maximum buffers of one vectored write.
+     */
+    static const int MAX_IOVEC = 64;
+
+    /**
+     * @brief Size of response chunks.
+     */
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    /**
+     * @brief Streaming actions wait when queued output of their connection
+     * exceeds this size.
+     */
+    static const size_t MAX_OUTPUT = 1024 * 1024;
+
     /**
      * @brief Fireloop logging system.
      */
@@ -272,6 +1250,54 @@ private:
      */
     static unsigned int bufSize;
 
+    /**
+     * @brief Maximum length of a command.
+     */
+    static unsigned long maxCommand;
+
+    /**
+     * @brief Number of worker threads.
+     */
+    static unsigned int workersNO;
+
+    /**
+     * @brief Capacity of workers queue.
+     */
+    static unsigned int queueSize;
+
+    /**
+     * @brief Milli seconds a command is parked when workers queue is full.
+     */
+    static unsigned int queueTimeout;
+
+    /**
+     * @brief Admission limits, zero when disabled.
+     */
+    static unsigned int maxConnections;
+    static unsigned int maxSessions;
+    static unsigned long maxBytes;
+    static unsigned int maxQueued;
+
+    /**
+     * @brief Deadlines of reading commands (milli seconds), zero when
+     * disabled.
+     */
+    static unsigned int headerTimeout;
+    static unsigned int bodyTimeout;
+    static unsigned int requestTimeout;
+
+    /**
+     * @brief Busy response of shed commands, and its untagged frame for
+     * shed connections; built once, by loop().
+     */
+    static string busyResponse;
+    static string busyFrame;
+
+    /**
+     * @brief Workers that run user commands.
+     */
+    static WorkerPool workers;
+
     /**
      * @brief Server TCP socket.
      */
@@ -281,6 +1307,99 @@ private:
      * @brief Server UNIX socket.
      */
     static Server unixSocket;
+
+    /**
+     * @brief Number of reactors.
+     */
+    static unsigned int reactorsNO;
+
+    /**
+     * @brief Reactors that accept connections and read user commands.
+     */
+    static Reactor *reactors;
+
+    /**
+     * @brief Counters of reactors.
+     */
+    static Counters *counters;
+
+    /**
+     * @brief Free lists of reactors.
+     */
+    static Pools *pools;
+
+    /**
+     * @brief Parked commands of reactors.
+     */
+    static Backlog *backlogs;
+
+    /**
+     * @brief System id of stats command, and whether it's served.
+     */
+    static XParam::XInt statsSysID;
+    static bool statsEnabled;
+
+    /**
+     * @brief Whether "sid" is of a stats command that is served.
+     */
+    static bool stats(XParam::XInt sid)
+    {
+        return statsEnabled && (sid == statsSysID);
+    }
+
+    /**
+     * @brief Key of Worker objects of worker threads.
+     */
+    static pthread_key_t workerKey;
+    static pthread_once_t workerOnce;
+
+    /**
+     * @brief Parser is renewed after commands larger than this, so that
+     * their tree isn't kept.
+     */
+    static const size_t MAX_RETAINED = 64 * 1024;
+
+    /**
+     * @brief Names of routing elements of commands.
+     */
+    static string sysIDTag;
+    static string cmdIDTag;
+    static string tokenTag;
+
+public:
+    /**
+     * @brief Prefix of frames carrying a binary envelope.
+     */
+    static const char BINARY_MAGIC[];
+
+    /**
+     * @brief Flags of binary envelope.
+     */
+    enum
+    {
+        BINARY_XML = 0x01, /**< Payload is an xml command */
+    };
+
+    /**
+     * @brief Commands of stats system id.
+     */
+    enum
+    {
+        STATS_SUMMARY = 0, /**< Returns get_stats() */
+        STATS_TRACES = 1,  /**< Returns get_traces() */
+    };
+
+private:
+
+    /**
+     * @brief TCP listener of each reactor, as watched by that reactor.
+     */
+    static Reactor::Watch *tcpWatches;
+
+    /**
+     * @brief UNIX listener, shared by all reactors.
+     */
+    static Reactor::Watch unixWatch;
 };
 
 } // namespace actrepo
@@ -0,0 +1,112 @@
+/**
+ * \file freelist.hpp
+ * Free list of released objects, reused instead of allocating new ones.
+ *
+ * Each FireLoop reactor keeps its released connections and sessions in free
+ * lists, so that connection churn reuses objects, with their buffers, instead
+ * of going through malloc and free. A free list is not thread safe; it's
+ * only touched by its owner thread.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * freelist is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <new>
+#include <stddef.h>
+#include <vector>
+
+namespace actrepo
+{
+
+/**
+ * \class FreeList
+ * @brief Keeps up to "capacity" released objects of type T for reuse.
+ */
+template <class T>
+class FreeList
+{
+public:
+    /**
+     * @brief FreeList constructor.
+     * @param capacity maximum number of kept objects; more released objects
+     * are deleted.
+     */
+    FreeList(size_t capacity = 1024) : capacity(capacity)
+    {
+    }
+
+    ~FreeList()
+    {
+        for (size_t i = 0; i < objects.size(); ++i)
+            delete objects[i];
+    }
+
+    /**
+     * @brief Returns a released object, or a new default constructed one
+     * when there is none; released objects are returned as they were put,
+     * to be reset by caller.
+     *
+     * @note Throws std::bad_alloc.
+     */
+    T *get()
+    {
+        T *object;
+
+        if (objects.empty())
+            return new T;
+        object = objects.back();
+        objects.pop_back();
+
+        return object;
+    }
+
+    /**
+     * @brief Releases an object, for get().
+     */
+    void put(T *object)
+    {
+        if (objects.size() < capacity) {
+            try {
+                objects.push_back(object);
+
+                return;
+            } catch (std::bad_alloc &exception) {
+            }
+        }
+        delete object;
+    }
+
+    /**
+     * @brief Returns number of kept objects.
+     */
+    size_t size() const
+    {
+        return objects.size();
+    }
+
+private:
+    /**
+     * @brief Kept objects; the most recently released one, whose memory is
+     * most likely in cache, is at the back.
+     */
+    std::vector<T *> objects;
+
+    size_t capacity;
+};
+
+} // namespace actrepo
@@ -0,0 +1,125 @@
+/**
+ * \file gate.hpp
+ * Counting gate that limits how many callers pass at the same time.
+ *
+ * ActionRepository puts a gate in front of actions with limited concurrency
+ * and in front of each priority lane. Callers that find a gate full are
+ * rejected at once, so no worker waits in a gate; commands wait for workers
+ * in queues by priority instead (WorkerPool).
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * gate is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <pthread.h>
+
+namespace actrepo
+{
+
+/**
+ * \class Gate
+ * @brief Lets at most "limit" callers in; zero limit means unlimited.
+ */
+class Gate
+{
+public:
+    /**
+     * \struct Stats
+     * @brief Snapshot of gate state.
+     */
+    struct Stats {
+        /**
+         * @brief Maximum number of callers inside, zero if unlimited.
+         */
+        unsigned int limit;
+
+        /**
+         * @brief Number of callers inside.
+         */
+        unsigned int running;
+
+        /**
+         * @brief Number of callers rejected because gate was full.
+         */
+        unsigned long rejected;
+    };
+
+    /**
+     * @brief Gate constructor.
+     * @param limit maximum number of callers inside, zero if unlimited.
+     */
+    Gate(unsigned int limit = 0);
+
+    ~Gate();
+
+    /**
+     * @brief Change limit of gate.
+     *
+     * @note Would be called before callers use the gate; limited() of an
+     * unlimited gate must not change while callers are inside.
+     */
+    void set_limit(unsigned int limit);
+
+    /**
+     * @brief Whether callers would enter() and leave() the gate; callers
+     * simply pass unlimited gates.
+     */
+    bool limited() const
+    {
+        return limit != 0;
+    }
+
+    /**
+     * @brief Enter the gate if it has room.
+     * @return false when gate is full and caller is rejected.
+     */
+    bool enter();
+
+    /**
+     * @brief Leave the gate.
+     */
+    void leave();
+
+    /**
+     * @brief Returns snapshot of gate state.
+     */
+    Stats get_stats();
+
+private:
+    /**
+     * @brief Protects gate state.
+     */
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief Maximum number of callers inside.
+     */
+    unsigned int limit;
+
+    /**
+     * @brief Number of callers inside.
+     */
+    unsigned int running;
+
+    /**
+     * @brief Number of rejected callers.
+     */
+    unsigned long rejected;
+};
+
+} // namespace actrepo
@@ -0,0 +1,321 @@
+/**
+ * \file metrics.hpp
+ * Latency histograms and counters of commands, per sub-system and action.
+ *
+ * Each thread records into its own table of histograms, keyed by sid/cid,
+ * so recording takes no lock and shares no cache line with other threads;
+ * readers merge tables of all threads into a snapshot. Commands with ids
+ * that are not registered share one "unknown" entry (UNKNOWN), and tables of
+ * exited threads are handed over to new threads, so tables stay bounded. Histograms are
+ * log-linear (HDR style): every power of two is split into 8 buckets, so a
+ * reported percentile is within 12.5% of the recorded value.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * metrics is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <map>
+#include <new>
+#include <pthread.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+namespace actrepo
+{
+
+/**
+ * \class Metrics
+ * @brief Records duration of command phases and counts of failures.
+ */
+class Metrics
+{
+public:
+    /**
+     * @brief Phases of a command.
+     */
+    enum Phase
+    {
+        READ,      /**< From frame header to complete command body */
+        QUEUE,     /**< Waiting in workers run queue */
+        PARSE,     /**< Parsing xml command */
+        ACTION,    /**< Running action */
+        SERIALIZE, /**< Building response */
+        WRITE,     /**< Sending response, or queueing it to reactor */
+        PHASES
+    };
+
+    /**
+     * @brief Counters of a command.
+     */
+    enum Counter
+    {
+        ERRORS,   /**< Action or command failed */
+        REJECTED, /**< Rejected by concurrency limits */
+        CACHED,   /**< Served by response cache, without running action */
+        COUNTERS
+    };
+
+    static const std::string phaseString[PHASES];
+    static const std::string counterString[COUNTERS];
+
+    /**
+     * @brief sid and cid of the record shared by commands with ids that are
+     * not known; no command has it.
+     */
+    static const long UNKNOWN = LONG_MIN;
+
+    /**
+     * @typedef FT_known
+     * defines the function that tells whether sid/cid is a registered
+     * command; called when a thread records a command for the first time.
+     */
+    typedef bool (*FT_known)(long sid, long cid);
+
+    /**
+     * \struct Summary
+     * @brief Summary of a histogram, durations in nano seconds.
+     */
+    struct Summary {
+        unsigned long long count;
+        unsigned long long total;
+        unsigned long long max;
+        unsigned long long p50;
+        unsigned long long p90;
+        unsigned long long p99;
+        unsigned long long p999;
+    };
+
+    /**
+     * \struct Record
+     * @brief Metrics of a command (sid/cid), merged from all threads.
+     */
+    struct Record {
+        long sid;
+        long cid;
+        /**
+         * @brief Names of sub-system and action, filled by caller.
+         */
+        std::string module;
+        std::string action;
+        unsigned long long counters[COUNTERS];
+        Summary phases[PHASES];
+    };
+
+    /**
+     * @brief Returns CLOCK_MONOTONIC time in nano seconds.
+     */
+    static unsigned long long now()
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /**
+     * @brief Record duration of a phase of command.
+     * @param sid sub-system id, -1 if unknown.
+     * @param cid command id, -1 if unknown.
+     * @param phase the phase.
+     * @param duration duration in nano seconds.
+     */
+    static void record(long sid, long cid, Phase phase, unsigned long long duration);
+
+    /**
+     * @brief Increment a counter of command.
+     */
+    static void count(long sid, long cid, Counter counter);
+
+    /**
+     * @brief Enable or disable recording; enabled by default.
+     */
+    static void set_enabled(bool enable);
+
+    /**
+     * @brief Set the function that validates ids of recorded commands; all
+     * ids are taken as they are until it's set. A later call replaces the
+     * function.
+     */
+    static void set_known(FT_known known);
+
+    /**
+     * @brief Returns metrics of all commands recorded so far.
+     *
+     * @note Could be called from any thread, while threads are recording.
+     */
+    static std::vector<Record> snapshot();
+
+private:
+    /**
+     * @brief Each power of two is split into 2^SUB_BITS buckets.
+     */
+    static const int SUB_BITS = 3;
+
+    /**
+     * @brief Durations are recorded up to 2^MAX_BITS nano seconds (~18
+     * minutes); longer ones fall in the last bucket.
+     */
+    static const int MAX_BITS = 40;
+
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    /**
+     * @brief Maximum number of commands per thread; further commands of
+     * thread are dropped.
+     */
+    static const int TABLE_SIZE = 512;
+
+    /**
+     * \struct Histogram
+     * @brief Histogram of a phase; written by its owner thread only.
+     */
+    struct Histogram {
+        std::atomic<unsigned long long> buckets[BUCKETS];
+        std::atomic<unsigned long long> count;
+        std::atomic<unsigned long long> total;
+        std::atomic<unsigned long long> max;
+    };
+
+    /**
+     * \struct Entry
+     * @brief Metrics of a command in a thread table.
+     */
+    struct Entry {
+        /**
+         * @brief Set, once sid/cid are written, by owner thread.
+         */
+        std::atomic<bool> used;
+        long sid;
+        long cid;
+        /**
+         * @brief Histograms of phases, allocated at first record.
+         */
+        std::atomic<Histogram *> phases[PHASES];
+        std::atomic<unsigned long long> counters[COUNTERS];
+    };
+
+    /**
+     * \struct Table
+     * @brief Open addressing table of a thread.
+     */
+    struct Table {
+        Entry entries[TABLE_SIZE];
+    };
+
+    /**
+     * \struct Merged
+     * @brief Accumulates metrics of a command from thread tables.
+     */
+    struct Merged {
+        unsigned long long counters[COUNTERS];
+        std::vector<unsigned long long> buckets[PHASES];
+        unsigned long long count[PHASES];
+        unsigned long long total[PHASES];
+        unsigned long long max[PHASES];
+    };
+
+    /**
+     * @brief Returns entry of command in table of calling thread, NULL if
+     * table is full; unknown commands get the shared UNKNOWN entry.
+     */
+    static Entry *lookup(long sid, long cid);
+
+    /**
+     * @brief Returns a table for calling thread, one of an exited thread if
+     * any, NULL if out of memory.
+     */
+    static Table *acquire();
+
+    /**
+     * @brief Destructor of "key"; keeps table of an exited thread for reuse.
+     */
+    static void release(void *table);
+
+    /**
+     * @brief Creates "key", once.
+     */
+    static void createKey();
+
+    /**
+     * @brief Returns bucket of a duration.
+     */
+    static int bucket(unsigned long long value);
+
+    /**
+     * @brief Returns the smallest duration of a bucket.
+     */
+    static unsigned long long lowest(int bucket);
+
+    /**
+     * @brief Add to a value that only calling thread writes; no atomic
+     * read-modify-write is needed.
+     */
+    static void add(std::atomic<unsigned long long> &value, unsigned long long amount)
+    {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Summarize merged histogram of a phase.
+     */
+    static void summarize(const Merged &merged, int phase, Summary &summary);
+
+private:
+    /**
+     * @brief Table of calling thread.
+     */
+    static __thread Table *local;
+
+    /**
+     * @brief Protects "tables".
+     */
+    static pthread_mutex_t mutex;
+
+    /**
+     * @brief Tables of all threads that recorded; never freed, as readers
+     * may be reading them.
+     */
+    static std::vector<Table *> tables;
+
+    /**
+     * @brief Tables of exited threads, protected by "mutex".
+     */
+    static std::vector<Table *> spare;
+
+    /**
+     * @brief Key whose destructor returns table of a thread when it exits.
+     */
+    static pthread_key_t key;
+    static pthread_once_t keyOnce;
+
+    /**
+     * @brief Validates ids of commands, NULL if not set.
+     */
+    static std::atomic<FT_known> known;
+
+    /**
+     * @brief Whether recording is enabled.
+     */
+    static std::atomic<bool> enabled;
+};
+
+} // namespace actrepo
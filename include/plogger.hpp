@@ -38,7 +38,8 @@ enum ELogID
     L_FIRE_CALLED,
     L_USER_COMMAND,
     L_ACTREPO_BAD_ACTION,
-    L_ACTREPO_BAD_MODULE
+    L_ACTREPO_BAD_MODULE,
+    L_ACTREPO_BUSY
 };
 
 /**
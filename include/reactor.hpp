@@ -0,0 +1,297 @@
+/**
+ * \file reactor.hpp
+ * Event loop that owns non-blocking I/O of FireLoop sockets.
+ *
+ * Listening sockets and all session sockets are watched by one epoll
+ * instance; handlers are called on the reactor thread whenever their
+ * socket is ready. Session reads happen here, so only a complete framed
+ * command is handed over to workers, and a slow or idle client costs no
+ * worker thread.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * reactor is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "actrepo.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+namespace actrepo
+{
+
+/**
+ * \class Reactor
+ * @brief Dispatches readiness of watched file descriptors to their handlers.
+ *
+ * @note putil's EPoll has no way to disarm and re-arm a descriptor, which
+ * sessions need while a worker owns them; so epoll is used directly.
+ *
+ * Timers are kept in a hashed wheel of TICK milli seconds slots: arming and
+ * cancelling a timer is O(1), and the reactor wakes up once per tick only
+ * while some timer is armed; timers fire at most one tick late.
+ */
+class Reactor
+{
+public:
+    /**
+     * @typedef FT_handler
+     * Handler of a watched file descriptor.
+     * @param reactor reactor that watches the descriptor.
+     * @param events ready events (Reactor::INPUT, ...).
+     * @param data data associated with descriptor.
+     */
+    typedef void (*FT_handler)(Reactor *reactor, unsigned int events, void *data);
+
+    /**
+     * @typedef FT_task
+     * Task posted to be run on reactor thread.
+     * @param reactor reactor that runs the task.
+     * @param data data associated with task.
+     */
+    typedef void (*FT_task)(Reactor *reactor, void *data);
+
+    enum
+    {
+        INPUT = EPOLLIN,                      /**< Ready to read */
+        OUTPUT = EPOLLOUT,                    /**< Ready to write */
+        HANGUP = EPOLLHUP | EPOLLRDHUP,       /**< Peer closed connection */
+        ERROR = EPOLLERR,                     /**< Error on descriptor */
+        EXCLUSIVE = EPOLLEXCLUSIVE,           /**< Wake one of reactors sharing fd */
+        ONESHOT = EPOLLONESHOT,               /**< Disarm after one event */
+    };
+
+    /**
+     * \struct Watch
+     * @brief A watched file descriptor, owned by the caller.
+     */
+    struct Watch {
+        /**
+         * @brief Watched file descriptor.
+         */
+        int fd;
+
+        /**
+         * @brief Handler to be called on readiness of "fd".
+         */
+        FT_handler handler;
+
+        /**
+         * @brief Data passed to handler.
+         */
+        void *data;
+    };
+
+    /**
+     * \struct Timer
+     * @brief A timer, owned by the caller; only touched on reactor thread.
+     */
+    struct Timer {
+        Timer() : task(NULL), data(NULL), expires(0), list(NULL), prev(NULL), next(NULL)
+        {
+        }
+
+        /**
+         * @brief Task to be run when timer expires, and its data.
+         */
+        FT_task task;
+        void *data;
+
+        /**
+         * @brief Tick that timer expires at.
+         */
+        unsigned long long expires;
+
+        /**
+         * @brief List that timer is linked in, NULL when not armed.
+         */
+        Timer **list;
+        Timer *prev;
+        Timer *next;
+    };
+
+    Reactor();
+
+    ~Reactor();
+
+    /**
+     * @brief Create epoll instance.
+     */
+    void create();
+
+    /**
+     * @brief Start watching a descriptor.
+     * @param watch watched descriptor, must live until remove().
+     * @param events interested events; zero adds the descriptor disarmed.
+     */
+    void add(Watch *watch, unsigned int events);
+
+    /**
+     * @brief Change interested events of a watched descriptor.
+     * @param watch watched descriptor.
+     * @param events interested events; zero disarms the descriptor.
+     *
+     * @note Could be called from any thread.
+     */
+    void modify(Watch *watch, unsigned int events);
+
+    /**
+     * @brief Stop watching a descriptor.
+     * @param watch watched descriptor.
+     *
+     * @note Could be called from any thread.
+     */
+    void remove(Watch *watch);
+
+    /**
+     * @brief Run a task on reactor thread.
+     * @param task task function.
+     * @param data data passed to task.
+     *
+     * @note Could be called from any thread; the reactor is woken up only
+     * when there is no other task waiting.
+     */
+    void post(FT_task task, void *data);
+
+    /**
+     * @brief Arm a timer, or re-arm an armed one; its task is run once, on
+     * reactor thread, after "timeout" milli seconds.
+     * @param timer timer, must live until it expires or is cancelled.
+     * @param timeout milli seconds to expire.
+     *
+     * @note Called on reactor thread.
+     */
+    void schedule(Timer *timer, unsigned long long timeout);
+
+    /**
+     * @brief Disarm a timer, if armed.
+     *
+     * @note Called on reactor thread.
+     */
+    void cancel(Timer *timer);
+
+    /**
+     * @brief Wait for events and dispatch them to handlers, forever.
+     */
+    void run();
+
+private:
+    /**
+     * \struct Task
+     * @brief A posted task.
+     */
+    struct Task {
+        FT_task task;
+        void *data;
+    };
+
+    /**
+     * @brief Handler of "eventFD", runs posted tasks.
+     */
+    static void runTasks(Reactor *reactor, unsigned int events, void *data);
+
+    /**
+     * @brief Run tasks of timers expired up to now.
+     */
+    void expireTimers();
+
+    /**
+     * @brief Link a timer in a list.
+     */
+    void link(Timer *timer, Timer **list);
+
+    /**
+     * @brief Returns monotonic time in milli seconds.
+     */
+    static unsigned long long milliseconds();
+
+private:
+    /**
+     * @brief Maximum events dispatched per epoll_wait().
+     */
+    static const int MAX_EVENTS = 256;
+
+    /**
+     * @brief Milli seconds per tick of timer wheel, and number of its slots;
+     * timers expiring beyond one turn of wheel wait in their slot for more
+     * turns.
+     */
+    static const unsigned int TICK = 100;
+    static const unsigned int SLOTS = 512;
+
+    /**
+     * @brief The epoll instance.
+     */
+    int epollFD;
+
+    /**
+     * @brief Wakes up reactor when a task is posted.
+     */
+    int eventFD;
+
+    /**
+     * @brief "eventFD" as watched by reactor.
+     */
+    Watch eventWatch;
+
+    /**
+     * @brief Protects "tasks".
+     */
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief Posted tasks, waiting to be run.
+     */
+    vector<Task> tasks;
+
+    /**
+     * @brief Tasks being run; kept to reuse its storage.
+     */
+    vector<Task> running;
+
+    /**
+     * @brief Timer wheel; a timer is linked in slot "expires % SLOTS".
+     */
+    Timer *wheel[SLOTS];
+
+    /**
+     * @brief Expired timers whose tasks are being run.
+     */
+    Timer *expired;
+
+    /**
+     * @brief Last tick that timers are expired up to.
+     */
+    unsigned long long tick;
+
+    /**
+     * @brief Number of armed timers.
+     */
+    unsigned int timers;
+};
+
+} // namespace actrepo
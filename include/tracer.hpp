@@ -0,0 +1,177 @@
+/**
+ * \file tracer.hpp
+ * Sampled timelines of requests, kept in a lock-free ring buffer.
+ *
+ * FireLoop traces one of every N requests, and every request slower than a
+ * threshold; the timeline of each traced request is written into a fixed
+ * ring of slots, overwriting the oldest one, and could be dumped at any time
+ * without stopping writers. Each slot is guarded by a sequence number
+ * (seqlock): a writer makes it odd while writing, and readers drop copies
+ * that were taken while it changed.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * tracer is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string.h>
+#include <vector>
+
+namespace actrepo
+{
+
+/**
+ * \class Tracer
+ * @brief Samples request timelines into a ring buffer.
+ */
+class Tracer
+{
+public:
+    /**
+     * \struct Timeline
+     * @brief Timeline of a request; times are Metrics::now() values, zero
+     * for points that request didn't reach.
+     */
+    struct Timeline {
+        /**
+         * @brief Order of record, increasing.
+         */
+        unsigned long long sequence;
+
+        long sid;
+        long cid;
+
+        /**
+         * @brief Request id of command, empty if untagged.
+         */
+        char tag[33];
+
+        /**
+         * @brief Whether request is failed.
+         */
+        bool failed;
+
+        unsigned long long accepted;   /**< Connection accepted */
+        unsigned long long firstByte;  /**< First byte of request read */
+        unsigned long long framed;     /**< Request body complete */
+        unsigned long long parsed;     /**< Command parsed */
+        unsigned long long actionStart;
+        unsigned long long actionEnd;
+        unsigned long long written;    /**< Response written or queued */
+    };
+
+    /**
+     * @brief Set sampling of requests.
+     * @param rate one of every "rate" requests of each thread is traced,
+     * zero disables sampling.
+     * @param threshold requests slower than "threshold" micro seconds are
+     * traced too, zero disables it.
+     */
+    static void set_sampling(unsigned int rate, unsigned long long threshold);
+
+    /**
+     * @brief Set number of timelines kept; ignored once the ring is
+     * allocated, at first record.
+     *
+     * @note Would be called before any request is traced.
+     */
+    static void set_capacity(unsigned int capacity);
+
+    /**
+     * @brief Whether a request would be traced; called once per request,
+     * after it's answered.
+     * @param elapsed duration of request in nano seconds.
+     */
+    static bool sampled(unsigned long long elapsed);
+
+    /**
+     * @brief Record timeline of a request.
+     *
+     * @note Lock-free; the timeline is dropped when its slot is being
+     * written by another thread.
+     */
+    static void record(const Timeline &timeline);
+
+    /**
+     * @brief Returns recorded timelines, oldest first.
+     *
+     * @note Could be called from any thread, while threads are recording.
+     */
+    static std::vector<Timeline> dump();
+
+private:
+    /**
+     * \struct Slot
+     * @brief A timeline in ring, guarded by "sequence".
+     */
+    struct Slot {
+        /**
+         * @brief Odd while slot is being written.
+         */
+        std::atomic<unsigned long long> sequence;
+
+        Timeline timeline;
+    };
+
+    /**
+     * \struct Ring
+     * @brief Slots of timelines, with the capacity they're allocated with.
+     */
+    struct Ring {
+        unsigned int capacity;
+        Slot *slots;
+    };
+
+    /**
+     * @brief Allocate ring, if not done yet.
+     */
+    static Ring *ring();
+
+    /**
+     * @brief Orders timelines by sequence.
+     */
+    static bool older(const Timeline &a, const Timeline &b);
+
+private:
+    /**
+     * @brief The ring, and capacity of a ring not allocated yet.
+     */
+    static std::atomic<Ring *> slots;
+    static std::atomic<unsigned int> capacity;
+
+    /**
+     * @brief Number of records so far; next slot is "head % capacity" of
+     * ring.
+     */
+    static std::atomic<unsigned long long> head;
+
+    /**
+     * @brief Sampling rate and slow threshold (nano seconds).
+     */
+    static std::atomic<unsigned int> rate;
+    static std::atomic<unsigned long long> threshold;
+
+    /**
+     * @brief Requests of calling thread, for sampling.
+     */
+    static __thread unsigned int requests;
+};
+
+} // namespace actrepo
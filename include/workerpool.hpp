@@ -0,0 +1,240 @@
+/**
+ * \file workerpool.hpp
+ * Fixed-size pool of worker threads fed by a bounded run queue.
+ *
+ * FireLoop hands every accepted session to this pool instead of creating
+ * a thread per connection. When the run queue is full, submitters either
+ * wait for a free slot (up to a timeout) or are rejected immediately, so
+ * a burst of requests can't exhaust the process threads.
+ *
+ * Copyright 2011-2022 Cloud Avid Co. (www.cloudavid.com)
+ *
+ * workerpool is part of pvm-actrepo.
+ *
+ * pvm-acrepo is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * pvm-acrepo is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with pvm-actrepo.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "actrepo.hpp"
+
+#include <cxxabi.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+namespace actrepo
+{
+
+/**
+ * \class WorkerPool
+ * @brief Runs submitted jobs on a fixed number of threads.
+ *
+ * Jobs are queued in a run queue per priority (ActionPolicy::Priority);
+ * workers take the oldest job of the highest priority queue, so queued
+ * jobs of lower priorities never delay higher ones.
+ */
+class WorkerPool
+{
+public:
+    /**
+     * @typedef FT_job
+     * Job function that would be run by one of the workers.
+     * @param data data associated with job at submission time.
+     */
+    typedef void (*FT_job)(void *data);
+
+    /**
+     * \struct Stats
+     * @brief Snapshot of pool state.
+     */
+    struct Stats {
+        /**
+         * @brief Number of worker threads.
+         */
+        unsigned int threads;
+
+        /**
+         * @brief Capacity of run queue of each priority.
+         */
+        unsigned int queueSize;
+
+        /**
+         * @brief Number of jobs waiting in run queues (queue depth).
+         */
+        unsigned int queued;
+
+        /**
+         * @brief Number of jobs waiting in run queue of each priority.
+         */
+        unsigned int laneQueued[ActionPolicy::PRIORITIES];
+
+        /**
+         * @brief Maximum queue depth seen since start.
+         */
+        unsigned int maxQueued;
+
+        /**
+         * @brief Number of workers running a job right now.
+         */
+        unsigned int busy;
+
+        /**
+         * @brief Number of accepted jobs.
+         */
+        unsigned long submitted;
+
+        /**
+         * @brief Number of jobs rejected because run queue was full.
+         */
+        unsigned long rejected;
+
+        /**
+         * @brief Sum of time jobs spent in run queue (micro seconds).
+         */
+        unsigned long long totalWait;
+
+        /**
+         * @brief Maximum time a job spent in run queue (micro seconds).
+         */
+        unsigned long long maxWait;
+    };
+
+    /**
+     * @brief WorkerPool constructor.
+     * @param name name of pool threads, used in logs.
+     */
+    WorkerPool(const string name);
+
+    ~WorkerPool();
+
+    /**
+     * @brief Create workers and run queues.
+     * @param threads number of worker threads.
+     * @param queueSize capacity of run queue of each priority.
+     *
+     * @note Would be called once, before any submit().
+     */
+    void start(unsigned int threads, unsigned int queueSize);
+
+    /**
+     * @brief Put a job in run queue of its priority.
+     * @param job job function.
+     * @param data data passed to job.
+     * @param timeout milli seconds to wait for a free slot when the run
+     * queue is full; zero means reject immediately.
+     * @param priority priority of job.
+     * @return false when job is rejected.
+     */
+    bool submit(FT_job job, void *data, unsigned int timeout,
+                ActionPolicy::Priority priority = ActionPolicy::NORMAL);
+
+    /**
+     * @brief Put a job in run queue of its priority if it has room, without
+     * waiting; not counted as rejected, for callers that retry it later.
+     * @return false when run queue is full.
+     */
+    bool offer(FT_job job, void *data, ActionPolicy::Priority priority = ActionPolicy::NORMAL);
+
+    /**
+     * @brief Returns number of jobs waiting in run queue.
+     */
+    unsigned int get_queued();
+
+    /**
+     * @brief Returns snapshot of pool state.
+     */
+    Stats get_stats();
+
+private:
+    /**
+     * \struct Job
+     * @brief Entry of run queue.
+     */
+    struct Job {
+        FT_job job;
+        void *data;
+        /**
+         * @brief Time that job is queued.
+         */
+        struct timespec queued;
+    };
+
+    /**
+     * @brief Thread function of workers.
+     * @param pool the pool that owns worker.
+     */
+    static void *worker(void *pool);
+
+    /**
+     * @brief Returns time elapsed since "since" in micro seconds.
+     */
+    static unsigned long long elapsed(const struct timespec &since);
+
+    /**
+     * \struct Lane
+     * @brief Run queue of a priority, a ring buffer of "queueSize" jobs.
+     */
+    struct Lane {
+        vector<Job> queue;
+
+        /**
+         * @brief Index of the oldest job in queue.
+         */
+        unsigned int head;
+    };
+
+    /**
+     * @brief Append a job to run queue of a priority, which has room;
+     * called with lock.
+     */
+    void push(FT_job job, void *data, ActionPolicy::Priority priority);
+
+private:
+    static LogSystem log;
+
+    /**
+     * @brief Name of pool threads.
+     */
+    string name;
+
+    /**
+     * @brief Protects run queue and statistics.
+     */
+    pthread_mutex_t mutex;
+
+    /**
+     * @brief Signaled when a job is queued.
+     */
+    pthread_cond_t notEmpty;
+
+    /**
+     * @brief Broadcast when a job is dequeued; waiters may wait for
+     * different queues.
+     */
+    pthread_cond_t notFull;
+
+    /**
+     * @brief Run queues, by priority.
+     */
+    Lane lanes[ActionPolicy::PRIORITIES];
+
+    /**
+     * @brief Pool statistics, "queued" and "laneQueued" are the number of
+     * jobs in queues.
+     */
+    Stats stats;
+};
+
+} // namespace actrepo
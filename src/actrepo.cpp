@@ -2,18 +2,262 @@
 
 namespace actrepo
 {
+/* Implementation of ResponseWriter Class.
+ */
+ResponseWriter::~ResponseWriter()
+{
+}
+
+void ResponseWriter::write(const string &data)
+{
+    write(data.data(), data.length());
+}
+
+/* Implementation of StringWriter Class.
+ */
+StringWriter::StringWriter(string &result) : result(result)
+{
+}
+
+void StringWriter::write(const char *data, size_t length)
+{
+    result.append(data, length);
+}
+
+/* Implementation of AsyncResult Class.
+ */
+AsyncResult::AsyncResult()
+    : completed(false), sid(-1), cid(-1), started(0), actionGate(NULL), laneGate(NULL),
+      inflight(NULL)
+{
+}
+
+AsyncResult::~AsyncResult()
+{
+}
+
+void AsyncResult::done(const string &result)
+{
+    if (completed.exchange(true))
+        return;
+    finish(false);
+    resolved(result);
+}
+
+void AsyncResult::fail(const Exception &exception)
+{
+    if (completed.exchange(true))
+        return;
+    finish(true);
+    rejected(exception);
+}
+
+void AsyncResult::finish(bool failed)
+{
+    if (inflight == NULL)
+        return;
+    Metrics::record(sid, cid, Metrics::ACTION, Metrics::now() - started);
+    if (failed)
+        Metrics::count(sid, cid, Metrics::ERRORS);
+    if (laneGate != NULL)
+        laneGate->leave();
+    if (actionGate != NULL)
+        actionGate->leave();
+    ActionRepository::unpin(inflight);
+}
+
+/* Implementation of BlockingResult Class.
+ */
+BlockingResult::BlockingResult() : ready(false), error(NULL)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+BlockingResult::~BlockingResult()
+{
+    delete error;
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+string BlockingResult::wait()
+{
+    pthread_mutex_lock(&mutex);
+    while (! ready)
+        pthread_cond_wait(&cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+    if (error != NULL)
+        throw *error;
+
+    return result;
+}
+
+void BlockingResult::resolved(const string &_result)
+{
+    pthread_mutex_lock(&mutex);
+    result = _result;
+    ready = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+void BlockingResult::rejected(const Exception &exception)
+{
+    pthread_mutex_lock(&mutex);
+    error = new Exception(exception);
+    ready = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
 /* Implementation of ActionList Class.
  */
+#ifdef __DEBUG__
+std::atomic<int> ActionList::traceLevel(TRACE_ALL);
+#else
+std::atomic<int> ActionList::traceLevel(TRACE_SAMPLED);
+#endif
+std::atomic<unsigned int> ActionList::sampleRate(100);
+__thread unsigned int ActionList::runs = 0;
+
+ActionList::ActionList() : interned(false)
+{
+}
+
+ActionList::~ActionList()
+{
+    for (size_t i = 0; i < Actions.size(); ++i)
+        delete Actions[i].gate;
+}
+
+void ActionList::set_traceLevel(TraceLevel level, unsigned int _sampleRate)
+{
+    sampleRate.store((_sampleRate == 0) ? 1 : _sampleRate, std::memory_order_relaxed);
+    traceLevel.store(level, std::memory_order_relaxed);
+}
+
+void ActionList::intern()
+{
+    module = getModule();
+    for (size_t i = 0; i < Actions.size(); ++i)
+        Actions[i].name = getActionName(i);
+    interned = true;
+}
+
 string ActionList::run(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
                        void *data)
 {
-    PLogger::threadInfo(getModule(), getActionName(cmdID));
-    PLogger::threadInfo(plogger::ThreadInfo::TI_ACTION, getActionName(cmdID));
+    string ret;
+
+    /* Bad command ids are reported by the traced path */
+    if (traced() || (cmdID < 0) || (cmdID >= (XParam::XInt) Actions.size()))
+        return runTraced(cmdID, st, rnode, data);
+    try {
+        const Action &action = Actions[cmdID];
+
+        if (action.action)
+            return action.action(st, rnode, data);
+        if (action.async)
+            return await(action, st, rnode, data);
+
+        StringWriter writer(ret);
+
+        action.stream(st, rnode, data, &writer);
+    } catch (std::exception &e) {
+        throw Exception(e.what(), TracePoint("action-list"));
+    }
+
+    return ret;
+}
+
+void ActionList::stream(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+                        void *data, ResponseWriter *writer)
+{
+    if (traced() || (cmdID < 0) || (cmdID >= (XParam::XInt) Actions.size())) {
+        streamTraced(cmdID, st, rnode, data, writer);
+
+        return;
+    }
+    try {
+        const Action &action = Actions[cmdID];
+
+        if (action.stream)
+            action.stream(st, rnode, data, writer);
+        else if (action.async)
+            writer->write(await(action, st, rnode, data));
+        else
+            writer->write(action.action(st, rnode, data));
+    } catch (std::exception &e) {
+        throw Exception(e.what(), TracePoint("action-list"));
+    }
+}
+
+void ActionList::start(XParam::XInt cmdID, ActionSource::Type st, const XParam::XmlNode *rnode,
+                       void *data, AsyncResult *result)
+{
+    try {
+        Actions[cmdID].async(st, rnode, data, result);
+    } catch (std::exception &e) {
+        result->fail(Exception(e.what(), TracePoint("action-list")));
+    }
+}
+
+string ActionList::await(const Action &action, ActionSource::Type st,
+                         const XParam::XmlNode *rnode, void *data)
+{
+    BlockingResult result;
+
+    try {
+        action.async(st, rnode, data, &result);
+    } catch (std::exception &e) {
+        result.fail(Exception(e.what(), TracePoint("action-list")));
+    }
+
+    return result.wait();
+}
+
+bool ActionList::traced()
+{
+    switch (traceLevel.load(std::memory_order_relaxed)) {
+    case TRACE_ALL:
+        return true;
+    case TRACE_SAMPLED:
+        return (++runs % sampleRate.load(std::memory_order_relaxed)) == 0;
+    default:
+        return false;
+    }
+}
+
+void ActionList::traceInfo(XParam::XInt cmdID)
+{
+    bool known = interned && (cmdID >= 0) && (cmdID < (XParam::XInt) Actions.size());
+    const string name = known ? Actions[cmdID].name : getActionName(cmdID);
+
+    PLogger::threadInfo(interned ? module : getModule(), name);
+    PLogger::threadInfo(plogger::ThreadInfo::TI_ACTION, name);
     PLogger::setMode(plogger::ThreadRecorder::TRM_REAL);
     PLogger::setBroadcast(true);
+}
+
+string ActionList::runTraced(XParam::XInt cmdID, ActionSource::Type st,
+                             const XParam::XmlNode *rnode, void *data)
+{
+    traceInfo(cmdID);
     CALL_FUNCTION;
     try {
-        string ret = Actions.at(cmdID)(st, rnode, data);
+        const Action &action = Actions.at(cmdID);
+        string ret;
+
+        if (action.action)
+            ret = action.action(st, rnode, data);
+        else if (action.async)
+            ret = await(action, st, rnode, data);
+        else {
+            StringWriter writer(ret);
+
+            action.stream(st, rnode, data, &writer);
+        }
         EXIT_FUNCTION_RETURN(ret);
     } catch (std::out_of_range &oor) {
         EXIT_FUNCTION_THROW(L_ACTREPO_BAD_ACTION);
@@ -23,10 +267,61 @@ string ActionList::run(XParam::XInt cmdID, ActionSource::Type st, const XParam::
     EXIT_FUNCTION;
 }
 
-void ActionList::push_action(FT_action act)
+void ActionList::streamTraced(XParam::XInt cmdID, ActionSource::Type st,
+                              const XParam::XmlNode *rnode, void *data, ResponseWriter *writer)
+{
+    traceInfo(cmdID);
+    CALL_FUNCTION;
+    try {
+        const Action &action = Actions.at(cmdID);
+
+        if (action.stream)
+            action.stream(st, rnode, data, writer);
+        else if (action.async)
+            writer->write(await(action, st, rnode, data));
+        else
+            writer->write(action.action(st, rnode, data));
+    } catch (std::out_of_range &oor) {
+        EXIT_FUNCTION_THROW(L_ACTREPO_BAD_ACTION);
+    } catch (std::exception &e) {
+        EXIT_FUNCTION_THROW_EXCEPTION(Exception(e.what(), TracePoint("action-list")));
+    }
+    EXIT_FUNCTION;
+}
+
+void ActionList::push_action(FT_action act, const ActionPolicy &policy)
+{
+    CALL_FUNCTION;
+    Action action = {act, NULL, NULL, policy, NULL};
+
+    if (policy.maxConcurrency > 0)
+        action.gate = new Gate(policy.maxConcurrency);
+
+    Actions.push_back(action);
+    EXIT_FUNCTION;
+}
+
+void ActionList::push_action(FT_streamAction act, const ActionPolicy &policy)
 {
     CALL_FUNCTION;
-    Actions.push_back(act);
+    Action action = {NULL, act, NULL, policy, NULL};
+
+    if (policy.maxConcurrency > 0)
+        action.gate = new Gate(policy.maxConcurrency);
+
+    Actions.push_back(action);
+    EXIT_FUNCTION;
+}
+
+void ActionList::push_action(FT_asyncAction act, const ActionPolicy &policy)
+{
+    CALL_FUNCTION;
+    Action action = {NULL, NULL, act, policy, NULL};
+
+    if (policy.maxConcurrency > 0)
+        action.gate = new Gate(policy.maxConcurrency);
+
+    Actions.push_back(action);
     EXIT_FUNCTION;
 }
 
@@ -45,22 +340,43 @@ string ActionList::getActionName(XParam::XInt cmdID)
 /* Implementation of ActionRepository Class.
  */
 LogSystem ActionRepository::log("actrepo");
-vector<ActionList *> ActionRepository::SSysActions;
+ActionRepository::Slot *ActionRepository::SSysActions = NULL;
+XParam::XInt ActionRepository::SSysNO = 0;
+Gate ActionRepository::lanes[ActionPolicy::PRIORITIES];
+ResponseCache ActionRepository::cache;
+pthread_mutex_t ActionRepository::swapLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ActionRepository::drainLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ActionRepository::drained = PTHREAD_COND_INITIALIZER;
+std::atomic<unsigned int> ActionRepository::draining(0);
 
 void ActionRepository::init(XParam::XInt ssysNO)
 {
     CALL_FUNCTION;
-    SSysActions.insert(SSysActions.begin(), ssysNO, (ActionList *) NULL);
+    if ((SSysActions != NULL) || (ssysNO <= 0))
+        EXIT_FUNCTION_THROW_EXCEPTION(Exception("Bad action repository initialization",
+                                                TracePoint("actrepo")));
+    SSysActions = new Slot[ssysNO];
+    for (XParam::XInt i = 0; i < ssysNO; ++i) {
+        SSysActions[i].actions.store(NULL);
+        SSysActions[i].inflight[0].store(0);
+        SSysActions[i].inflight[1].store(0);
+        SSysActions[i].generation.store(0);
+    }
+    SSysNO = ssysNO;
+    Metrics::set_known(known);
     EXIT_FUNCTION;
 }
 
 void ActionRepository::regActList(XParam::XInt SysID, ActionList *actlist)
 {
     CALL_FUNCTION;
-    try {
-        SSysActions.at(SysID) = actlist;
-    } catch (std::out_of_range &oor) {
+    if ((SysID < 0) || (SysID >= SSysNO))
         EXIT_FUNCTION_THROW(L_ACTREPO_BAD_MODULE);
+    if (actlist != NULL)
+        actlist->intern();
+    if (swap(&SSysActions[SysID], actlist) != NULL) {
+        /* Results of replaced actions are not served anymore */
+        cache.clear();
     }
     EXIT_FUNCTION;
 }
@@ -68,29 +384,362 @@ void ActionRepository::regActList(XParam::XInt SysID, ActionList *actlist)
 void ActionRepository::unregActList(XParam::XInt SysID)
 {
     CALL_FUNCTION;
-    try {
-        SSysActions.at(SysID) = NULL;
-    } catch (std::out_of_range &oor) {
+    if ((SysID < 0) || (SysID >= SSysNO))
         EXIT_FUNCTION_THROW(L_ACTREPO_BAD_MODULE);
-    }
+    if (swap(&SSysActions[SysID], NULL) != NULL)
+        cache.clear();
     EXIT_FUNCTION;
 }
 
 string ActionRepository::runCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
-                                const XParam::XmlNode *rnode, void *data)
+                                const XParam::XmlNode *rnode, void *data, const string &scope)
 {
-    CALL_FUNCTION;
+    ActionList *actions;
+    std::atomic<unsigned long> *pinned = pin(sid, actions);
+    unsigned int ttl;
+
+    if (pinned == NULL)
+        fail(L_ACTREPO_BAD_MODULE);
+
+    Unpin unpin(pinned);
+
+    if (cacheable(actions, cid, rnode, ttl))
+        return fetch(actions, sid, cid, st, rnode, data, scope, ttl);
+
+    return execute(actions, sid, cid, st, rnode, data);
+}
+
+void ActionRepository::streamCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
+                                 const XParam::XmlNode *rnode, void *data,
+                                 ResponseWriter *writer, const string &scope)
+{
+    ActionList *actions;
+    std::atomic<unsigned long> *pinned = pin(sid, actions);
+    unsigned int ttl;
+
+    if (pinned == NULL)
+        fail(L_ACTREPO_BAD_MODULE);
+
+    Unpin unpin(pinned);
+
+    if (cacheable(actions, cid, rnode, ttl)) {
+        writer->write(fetch(actions, sid, cid, st, rnode, data, scope, ttl));
+        return;
+    }
+
+    Admission admission;
+
+    if (! admit(actions, cid, admission)) {
+        Metrics::count(sid, cid, Metrics::REJECTED);
+        fail(L_ACTREPO_BUSY);
+    }
+    unsigned long long started = Metrics::now();
+
     try {
-        if (SSysActions.at(sid) != NULL) {
-            EXIT_FUNCTION_RETURN(SSysActions[sid]->run(cid, st, rnode, data));
-        } else
-            EXIT_FUNCTION_THROW(L_ACTREPO_BAD_MODULE);
-    } catch (std::out_of_range &oor) {
-        EXIT_FUNCTION_THROW(L_ACTREPO_BAD_MODULE);
+        actions->stream(cid, st, rnode, data, writer);
     } catch (std::exception &e) {
-        EXIT_FUNCTION_THROW_EXCEPTION(Exception(e.what(), TracePoint("action_list")));
+        Metrics::record(sid, cid, Metrics::ACTION, Metrics::now() - started);
+        Metrics::count(sid, cid, Metrics::ERRORS);
+        throw Exception(e.what(), TracePoint("action_list"));
     }
+    Metrics::record(sid, cid, Metrics::ACTION, Metrics::now() - started);
+}
+
+bool ActionRepository::startCmd(XParam::XInt sid, XParam::XInt cid, ActionSource::Type st,
+                                const XParam::XmlNode *rnode, void *data, AsyncResult *result,
+                                const string &scope)
+{
+    ActionList *actions;
+    std::atomic<unsigned long> *pinned = pin(sid, actions);
+    unsigned int ttl;
+
+    if (pinned == NULL)
+        return false;
+
+    Unpin unpin(pinned);
+
+    if (cacheable(actions, cid, rnode, ttl)) {
+        Load context = {actions, sid, cid, st, rnode, data};
+        string key;
+        string value;
+        bool hit = false;
+
+        /* An identical command being run completes this one; none waits */
+        ResponseCache::key(key, sid, cid, scope, rnode);
+        try {
+            if (cache.fetch(key, ttl, load, &context, complete, result, value, hit))
+                result->done(value);
+        } catch (Exception &e) {
+            result->fail(e);
+        }
+        if (hit)
+            Metrics::count(sid, cid, Metrics::CACHED);
+
+        return true;
+    }
+
+    if ((cid < 0) || (cid >= (XParam::XInt) actions->Actions.size()) ||
+        (actions->Actions[cid].async == NULL))
+        return false;
+
+    Admission admission;
+
+    if (! admit(actions, cid, admission)) {
+        Metrics::count(sid, cid, Metrics::REJECTED);
+        fail(L_ACTREPO_BUSY);
+    }
+    /* Hand gates and a pin of sub-system over to result, released when
+     * action is complete.
+     */
+    pinned->fetch_add(1);
+    result->sid = sid;
+    result->cid = cid;
+    result->actionGate = admission.action;
+    result->laneGate = admission.lane;
+    result->inflight = pinned;
+    admission.action = NULL;
+    admission.lane = NULL;
+    result->started = Metrics::now();
+    actions->start(cid, st, rnode, data, result);
+
+    return true;
+}
+
+bool ActionRepository::known(long sid, long cid)
+{
+    ActionPolicy policy;
+
+    return get_policy(sid, cid, policy);
+}
+
+bool ActionRepository::get_policy(XParam::XInt sid, XParam::XInt cid, ActionPolicy &policy)
+{
+    bool async;
+
+    return get_policy(sid, cid, policy, async);
+}
+
+bool ActionRepository::get_policy(XParam::XInt sid, XParam::XInt cid, ActionPolicy &policy,
+                                  bool &async)
+{
+    ActionList *actions;
+    std::atomic<unsigned long> *pinned = pin(sid, actions);
+
+    if (pinned == NULL)
+        return false;
+
+    Unpin unpin(pinned);
+
+    if ((cid < 0) || (cid >= (XParam::XInt) actions->Actions.size()))
+        return false;
+    policy = actions->Actions[cid].policy;
+    async = (actions->Actions[cid].async != NULL);
+
+    return true;
+}
+
+void ActionRepository::set_laneLimit(ActionPolicy::Priority priority, unsigned int limit)
+{
+    CALL_FUNCTION;
+    if ((priority < 0) || (priority >= ActionPolicy::PRIORITIES))
+        EXIT_FUNCTION_THROW_EXCEPTION(Exception("Bad priority lane", TracePoint("actrepo")));
+    lanes[priority].set_limit(limit);
     EXIT_FUNCTION;
 }
 
+Gate::Stats ActionRepository::get_laneStats(ActionPolicy::Priority priority)
+{
+    return lanes[priority].get_stats();
+}
+
+vector<Metrics::Record> ActionRepository::get_metrics()
+{
+    vector<Metrics::Record> records = Metrics::snapshot();
+    ActionList *actions;
+    std::atomic<unsigned long> *pinned;
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        pinned = pin(records[i].sid, actions);
+        if (pinned == NULL)
+            continue;
+
+        Unpin unpin(pinned);
+
+        records[i].module = actions->module;
+        if ((records[i].cid >= 0) && (records[i].cid < (XParam::XInt) actions->Actions.size()))
+            records[i].action = actions->Actions[records[i].cid].name;
+    }
+
+    return records;
+}
+
+void ActionRepository::set_cacheSize(unsigned int size)
+{
+    cache.set_capacity(size);
+}
+
+ResponseCache::Stats ActionRepository::get_cacheStats()
+{
+    return cache.get_stats();
+}
+
+bool ActionRepository::cacheable(ActionList *actions, XParam::XInt cid,
+                                 const XParam::XmlNode *rnode, unsigned int &ttl)
+{
+    if ((rnode == NULL) || (cid < 0) || (cid >= (XParam::XInt) actions->Actions.size()))
+        return false;
+    ttl = actions->Actions[cid].policy.cacheTTL;
+
+    return ttl > 0;
+}
+
+string ActionRepository::execute(ActionList *actions, XParam::XInt sid, XParam::XInt cid,
+                                 ActionSource::Type st, const XParam::XmlNode *rnode, void *data)
+{
+    Admission admission;
+
+    if (! admit(actions, cid, admission)) {
+        Metrics::count(sid, cid, Metrics::REJECTED);
+        fail(L_ACTREPO_BUSY);
+    }
+    string result;
+    unsigned long long started = Metrics::now();
+
+    try {
+        result = actions->run(cid, st, rnode, data);
+    } catch (std::exception &e) {
+        Metrics::record(sid, cid, Metrics::ACTION, Metrics::now() - started);
+        Metrics::count(sid, cid, Metrics::ERRORS);
+        throw Exception(e.what(), TracePoint("action_list"));
+    }
+    Metrics::record(sid, cid, Metrics::ACTION, Metrics::now() - started);
+
+    return result;
+}
+
+void ActionRepository::fail(ELogID logID)
+{
+    CALL_FUNCTION;
+    EXIT_FUNCTION_THROW(logID);
+}
+
+string ActionRepository::load(void *_load)
+{
+    Load *load = static_cast<Load *>(_load);
+
+    return execute(load->actions, load->sid, load->cid, load->st, load->rnode, load->data);
+}
+
+void ActionRepository::complete(void *waiter, const string *value, const Exception *error)
+{
+    AsyncResult *result = static_cast<AsyncResult *>(waiter);
+
+    if (value != NULL)
+        result->done(*value);
+    else
+        result->fail(*error);
+}
+
+string ActionRepository::fetch(ActionList *actions, XParam::XInt sid, XParam::XInt cid,
+                               ActionSource::Type st, const XParam::XmlNode *rnode, void *data,
+                               const string &scope, unsigned int ttl)
+{
+    Load context = {actions, sid, cid, st, rnode, data};
+    string key;
+    string result;
+    bool hit;
+
+    ResponseCache::key(key, sid, cid, scope, rnode);
+    cache.fetch(key, ttl, load, &context, NULL, NULL, result, hit);
+    if (hit)
+        Metrics::count(sid, cid, Metrics::CACHED);
+
+    return result;
+}
+
+bool ActionRepository::admit(ActionList *actions, XParam::XInt cid, Admission &admission)
+{
+    const ActionList::Action *action;
+    Gate *lane;
+
+    /* Bad command ids are left to be reported by the action list */
+    if ((cid < 0) || (cid >= (XParam::XInt) actions->Actions.size()))
+        return true;
+    action = &actions->Actions[cid];
+    lane = &lanes[action->policy.priority];
+    if ((action->gate == NULL) && ! lane->limited())
+        return true;
+    /* A worker is never parked on a full gate; commands wait for workers in
+     * queues by priority instead.
+     */
+    if (action->gate != NULL) {
+        if (! action->gate->enter())
+            return false;
+        admission.action = action->gate;
+    }
+    if (lane->limited()) {
+        if (! lane->enter())
+            return false;
+        admission.lane = lane;
+    }
+
+    return true;
+}
+
+std::atomic<unsigned long> *ActionRepository::pin(XParam::XInt sid, ActionList *&actions)
+{
+    Slot *slot;
+    std::atomic<unsigned long> *pinned;
+
+    if ((sid < 0) || (sid >= SSysNO))
+        return NULL;
+    slot = &SSysActions[sid];
+    pinned = &slot->inflight[slot->generation.load() & 1];
+    pinned->fetch_add(1);
+    actions = slot->actions.load();
+    if (actions == NULL) {
+        unpin(pinned);
+
+        return NULL;
+    }
+
+    return pinned;
+}
+
+void ActionRepository::unpin(std::atomic<unsigned long> *pinned)
+{
+    if ((pinned->fetch_sub(1) == 1) && (draining.load() > 0)) {
+        pthread_mutex_lock(&drainLock);
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&drainLock);
+    }
+}
+
+ActionList *ActionRepository::swap(Slot *slot, ActionList *actions)
+{
+    unsigned int generation;
+    std::atomic<unsigned long> *pinned;
+
+    pthread_mutex_lock(&swapLock);
+    actions = slot->actions.exchange(actions);
+    /* Commands pinning the slot from now on count in a new generation, so
+     * the previous one drains even under steady load. Two rounds cover
+     * commands that read generation just before it's flipped; they see the
+     * new list anyway, as it's stored before the flip.
+     */
+    for (int round = 0; (actions != NULL) && (round < 2); ++round) {
+        generation = slot->generation.fetch_add(1);
+        pinned = &slot->inflight[generation & 1];
+        draining.fetch_add(1);
+        pthread_mutex_lock(&drainLock);
+        while (pinned->load() != 0)
+            pthread_cond_wait(&drained, &drainLock);
+        pthread_mutex_unlock(&drainLock);
+        draining.fetch_sub(1);
+    }
+    pthread_mutex_unlock(&swapLock);
+
+    return actions;
+}
+
 } // namespace actrepo
@@ -0,0 +1,224 @@
+#include "cache.hpp"
+
+namespace actrepo
+{
+
+ResponseCache::ResponseCache(unsigned int capacity)
+{
+    for (unsigned int i = 0; i < SHARDS; ++i) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+        shards[i].hits = 0;
+        shards[i].misses = 0;
+        shards[i].coalesced = 0;
+    }
+    set_capacity(capacity);
+}
+
+ResponseCache::~ResponseCache()
+{
+    for (unsigned int i = 0; i < SHARDS; ++i)
+        pthread_mutex_destroy(&shards[i].mutex);
+}
+
+void ResponseCache::set_capacity(unsigned int capacity)
+{
+    shardCapacity = (capacity + SHARDS - 1) / SHARDS;
+}
+
+bool ResponseCache::fetch(const std::string &key, unsigned int ttl, FT_load load, void *context,
+                          FT_done done, void *waiter, std::string &result, bool &hit)
+{
+    Shard &_shard = shard(key);
+    std::unordered_map<std::string, Entries::iterator>::iterator entry;
+    std::unordered_map<std::string, Flight>::iterator inflight;
+    bool leader = false;
+
+    pthread_mutex_lock(&_shard.mutex);
+    entry = _shard.index.find(key);
+    if (entry != _shard.index.end()) {
+        if (entry->second->expires > Metrics::now()) {
+            _shard.entries.splice(_shard.entries.begin(), _shard.entries, entry->second);
+            result = entry->second->result;
+            _shard.hits++;
+            pthread_mutex_unlock(&_shard.mutex);
+            hit = true;
+
+            return true;
+        }
+        _shard.entries.erase(entry->second);
+        _shard.index.erase(entry);
+    }
+    inflight = _shard.flights.find(key);
+    if ((inflight != _shard.flights.end()) && (done != NULL)) {
+        /* An identical command is being run; its caller completes this one */
+        try {
+            inflight->second.waiters.push_back(std::make_pair(done, waiter));
+            _shard.coalesced++;
+            pthread_mutex_unlock(&_shard.mutex);
+            hit = true;
+
+            return false;
+        } catch (std::bad_alloc &exception) {
+        }
+    }
+    /* Callers that can't be completed later load it themselves */
+    if (inflight == _shard.flights.end()) {
+        _shard.flights[key];
+        leader = true;
+    }
+    _shard.misses++;
+    pthread_mutex_unlock(&_shard.mutex);
+    hit = false;
+
+    try {
+        result = load(context);
+    } catch (putil::Exception &e) {
+        if (leader)
+            land(_shard, key, ttl, NULL, &e);
+        throw;
+    } catch (...) {
+        if (leader) {
+            putil::Exception error("Action failed", putil::TracePoint("cache"));
+
+            land(_shard, key, ttl, NULL, &error);
+        }
+        throw;
+    }
+    if (leader)
+        land(_shard, key, ttl, &result, NULL);
+
+    return true;
+}
+
+void ResponseCache::land(Shard &shard, const std::string &key, unsigned int ttl,
+                         const std::string *result, const putil::Exception *error)
+{
+    std::unordered_map<std::string, Flight>::iterator inflight;
+    std::vector<std::pair<FT_done, void *> > waiters;
+
+    pthread_mutex_lock(&shard.mutex);
+    inflight = shard.flights.find(key);
+    if (inflight != shard.flights.end()) {
+        waiters.swap(inflight->second.waiters);
+        shard.flights.erase(inflight);
+    }
+    if (result != NULL)
+        store(shard, key, *result, Metrics::now() + ttl * 1000000ULL);
+    pthread_mutex_unlock(&shard.mutex);
+
+    for (size_t i = 0; i < waiters.size(); ++i)
+        waiters[i].first(waiters[i].second, result, error);
+}
+
+void ResponseCache::clear()
+{
+    for (unsigned int i = 0; i < SHARDS; ++i) {
+        pthread_mutex_lock(&shards[i].mutex);
+        shards[i].entries.clear();
+        shards[i].index.clear();
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
+
+ResponseCache::Stats ResponseCache::get_stats()
+{
+    Stats stats = Stats();
+
+    for (unsigned int i = 0; i < SHARDS; ++i) {
+        pthread_mutex_lock(&shards[i].mutex);
+        stats.entries += shards[i].index.size();
+        stats.hits += shards[i].hits;
+        stats.misses += shards[i].misses;
+        stats.coalesced += shards[i].coalesced;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+
+    return stats;
+}
+
+void ResponseCache::key(std::string &key, long sid, long cid, const std::string &scope,
+                        const putil::XParam::XmlNode *rnode)
+{
+    key = std::to_string(sid) + ' ' + std::to_string(cid) + ' ' + std::to_string(scope.length()) +
+          ':' + scope;
+    canonicalize(key, rnode->cobj());
+}
+
+ResponseCache::Shard &ResponseCache::shard(const std::string &key)
+{
+    return shards[std::hash<std::string>()(key) % SHARDS];
+}
+
+void ResponseCache::store(Shard &shard, const std::string &key, const std::string &result,
+                          unsigned long long expires)
+{
+    Entry entry;
+
+    if (shardCapacity == 0)
+        return;
+    entry.key = key;
+    entry.result = result;
+    entry.expires = expires;
+    shard.entries.push_front(entry);
+    shard.index[key] = shard.entries.begin();
+    while (shard.entries.size() > shardCapacity) {
+        shard.index.erase(shard.entries.back().key);
+        shard.entries.pop_back();
+    }
+}
+
+bool ResponseCache::notSpace(char c)
+{
+    return ! isspace((unsigned char) c);
+}
+
+void ResponseCache::canonicalize(std::string &out, const _xmlNode *node)
+{
+    std::vector<std::pair<std::string, std::string> > attributes;
+    const char *content;
+    const char *end;
+
+    /* Names and values are length prefixed, so that no content could be
+     * taken for structure.
+     */
+    switch (node->type) {
+    case XML_ELEMENT_NODE:
+        for (const xmlAttr *attribute = node->properties; attribute != NULL;
+             attribute = attribute->next) {
+            xmlChar *value = xmlNodeListGetString(node->doc, attribute->children, 1);
+
+            attributes.push_back(std::make_pair((const char *) attribute->name,
+                                                value ? (const char *) value : ""));
+            xmlFree(value);
+        }
+        std::sort(attributes.begin(), attributes.end());
+        out += 'E' + std::to_string(strlen((const char *) node->name)) + ':';
+        out += (const char *) node->name;
+        for (size_t i = 0; i < attributes.size(); ++i) {
+            out += 'A' + std::to_string(attributes[i].first.length()) + ':' + attributes[i].first;
+            out += std::to_string(attributes[i].second.length()) + ':' + attributes[i].second;
+        }
+        for (const xmlNode *child = node->children; child != NULL; child = child->next)
+            canonicalize(out, child);
+        out += '/';
+        break;
+    case XML_TEXT_NODE:
+    case XML_CDATA_SECTION_NODE:
+        if (node->content == NULL)
+            break;
+        content = (const char *) node->content;
+        end = content + strlen(content);
+        /* Whitespace between elements is formatting; text of parameters is
+         * kept as it is.
+         */
+        if (std::find_if(content, end, notSpace) == end)
+            break;
+        out += 'T' + std::to_string(end - content) + ':';
+        out.append(content, end - content);
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace actrepo
@@ -8,12 +8,43 @@ string FireLoop::ip = "0.0.0.0";
 int FireLoop::port = 7090;
 
 string FireLoop::unixSocketPath;
-unsigned int FireLoop::bufSize;
+unsigned int FireLoop::bufSize = 4096;
+unsigned long FireLoop::maxCommand = 16 * 1024 * 1024;
+unsigned int FireLoop::workersNO = 64;
+unsigned int FireLoop::queueSize = 8192;
+unsigned int FireLoop::queueTimeout = 1000;
+unsigned int FireLoop::maxConnections = 0;
+unsigned int FireLoop::maxSessions = 0;
+unsigned long FireLoop::maxBytes = 0;
+unsigned int FireLoop::maxQueued = 0;
+unsigned int FireLoop::headerTimeout = 10000;
+unsigned int FireLoop::bodyTimeout = 60000;
+unsigned int FireLoop::requestTimeout = 120000;
+string FireLoop::busyResponse;
+string FireLoop::busyFrame;
+
+WorkerPool FireLoop::workers("fire");
 
 Server FireLoop::tcpSocket(SockDom::IPV4, SockType::TCP);
 
 Server FireLoop::unixSocket(SockDom::UNIX, SockType::TCP);
 
+unsigned int FireLoop::reactorsNO = 1;
+Reactor *FireLoop::reactors = NULL;
+Counters *FireLoop::counters = NULL;
+Pools *FireLoop::pools = NULL;
+Backlog *FireLoop::backlogs = NULL;
+XParam::XInt FireLoop::statsSysID = -1;
+bool FireLoop::statsEnabled = false;
+pthread_key_t FireLoop::workerKey;
+pthread_once_t FireLoop::workerOnce = PTHREAD_ONCE_INIT;
+const char FireLoop::BINARY_MAGIC[] = "PVB1";
+string FireLoop::sysIDTag = "sysID";
+string FireLoop::cmdIDTag = "cmdID";
+string FireLoop::tokenTag = "token";
+Reactor::Watch *FireLoop::tcpWatches = NULL;
+Reactor::Watch FireLoop::unixWatch;
+
 const string ResponseStatus::typeString[ResponseStatus::MAX] = {
     "success", /* SUCCESS */
     "warning", /* WARNING */
@@ -51,35 +82,440 @@ void Response::set_description(const string _description)
     description = _description;
 }
 
+pthread_once_t Response::learned = PTHREAD_ONCE_INIT;
+bool Response::fastPath = false;
+string Response::head[ResponseStatus::MAX];
+string Response::tail[ResponseStatus::MAX];
+string Response::empty[ResponseStatus::MAX];
+string Response::escaped[128];
+bool Response::known[128];
+bool Response::verbatim[128];
+
+void Response::learn()
+{
+    const string marker = "pvmActrepoProbe7f3a";
+    const char *samples[] = {"  leading and trailing  ", "a\r\nb\tc", "]]>", "<a b=\"c\">&amp;'</a>",
+                             "x"};
+    string xml;
+    string fast;
+    size_t position;
+
+    try {
+        for (int s = 0; s < ResponseStatus::MAX; ++s) {
+            Response response;
+
+            response.set_status(s);
+            response.set_description(marker);
+            xml = response.xml();
+            position = xml.find(marker);
+            if (position == string::npos)
+                return;
+            head[s] = xml.substr(0, position);
+            tail[s] = xml.substr(position + marker.length());
+
+            response.set_description("");
+            empty[s] = response.xml();
+        }
+    } catch (Exception &e) {
+        return;
+    } catch (std::exception &e) {
+        return;
+    }
+    for (int c = 1; c < 128; ++c) {
+        /* Characters that can't be learned take the generic path */
+        try {
+            Response response;
+
+            response.set_description(marker + (char) c + marker);
+            xml = response.xml();
+            position = head[0].length() + marker.length();
+            if ((xml.compare(0, position, head[0] + marker) != 0) ||
+                (xml.find(marker, position) == string::npos))
+                continue;
+            escaped[c] = xml.substr(position, xml.find(marker, position) - position);
+            verbatim[c] = (escaped[c].length() == 1) && (escaped[c][0] == c);
+            known[c] = true;
+        } catch (Exception &e) {
+        } catch (std::exception &e) {
+        }
+    }
+    /* Characters are not always escaped on their own; verify */
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i) {
+        try {
+            Response response;
+
+            response.set_description(samples[i]);
+            fast.clear();
+            if (escape(fast, ResponseStatus::SUCCESS, samples[i]) && (fast != response.xml()))
+                return;
+        } catch (Exception &e) {
+            return;
+        } catch (std::exception &e) {
+            return;
+        }
+    }
+    fastPath = true;
+}
+
+bool Response::escape(string &out, const int _status, const string &_description)
+{
+    const char *data = _description.data();
+    size_t length = _description.length();
+    size_t start = out.length();
+    size_t begin = 0;
+    unsigned char c;
+
+    if ((_status < 0) || (_status >= ResponseStatus::MAX))
+        return false;
+    if (length == 0) {
+        out += empty[_status];
+
+        return true;
+    }
+    out.reserve(start + head[_status].length() + length + length / 8 + tail[_status].length());
+    out += head[_status];
+    for (size_t i = 0; i < length; ++i) {
+        c = data[i];
+        if ((c < 128) && verbatim[c])
+            continue;
+        if ((c >= 128) || ! known[c]) {
+            out.resize(start);
+
+            return false;
+        }
+        out.append(data + begin, i - begin);
+        out += escaped[c];
+        begin = i + 1;
+    }
+    out.append(data + begin, length - begin);
+    out += tail[_status];
+
+    return true;
+}
+
+void Response::serialize(string &out, const int _status, const string &_description)
+{
+    pthread_once(&learned, learn);
+    if (fastPath && escape(out, _status, _description))
+        return;
+
+    Response response;
+
+    response.set_status(_status);
+    response.set_description(_description);
+    out += response.xml();
+}
+
+/* Implementation of "Connection" structure */
+
+Connection::Connection() :
+    socket_fd(-1),
+    port(0),
+    reactor(NULL),
+    counters(NULL),
+    accepted(0),
+    firstByte(0),
+    armedEvents(0),
+    blocked(false),
+    inputBegin(0),
+    inputEnd(0),
+    reading(NULL),
+    received(0),
+    discard(0),
+    phase(IDLE),
+    requestDeadline(0),
+    keepAlive(false),
+    closing(false),
+    inflight(0),
+    ordered(false),
+    outputOffset(0),
+    outputBytes(0),
+    broken(false),
+    posted(0),
+    released(false)
+{
+    memset(&address, 0, sizeof(address));
+    pthread_mutex_init(&writeLock, NULL);
+    pthread_cond_init(&drained, NULL);
+}
+
+Connection::~Connection()
+{
+    delete reading;
+    pthread_cond_destroy(&drained);
+    pthread_mutex_destroy(&writeLock);
+}
+
+void Connection::open(int sfd, unsigned int bufSize)
+{
+    char _ip[INET6_ADDRSTRLEN];
+
+    socket_fd = sfd;
+    reactor = NULL;
+    counters = NULL;
+    accepted = Metrics::now();
+    firstByte = 0;
+    armedEvents = 0;
+    blocked = false;
+    input.resize(bufSize);
+    inputBegin = 0;
+    inputEnd = 0;
+    reading = NULL;
+    received = 0;
+    discard = 0;
+    phase = IDLE;
+    requestDeadline = 0;
+    keepAlive = false;
+    closing = false;
+    inflight = 0;
+    ordered = false;
+    output.clear();
+    outputOffset = 0;
+    outputBytes = 0;
+    broken = false;
+    posted = 0;
+    released = false;
+
+    if (address.ss_family == AF_INET) {
+        const struct sockaddr_in *peer = (const struct sockaddr_in *) &address;
+
+        inet_ntop(AF_INET, &peer->sin_addr, _ip, sizeof(_ip));
+        port = ntohs(peer->sin_port);
+        ip.assign(_ip);
+    } else if (address.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *peer = (const struct sockaddr_in6 *) &address;
+
+        inet_ntop(AF_INET6, &peer->sin6_addr, _ip, sizeof(_ip));
+        port = ntohs(peer->sin6_port);
+        ip.assign(_ip);
+    } else {
+        /* UNIX socket peers have no ip */
+        port = 0;
+        ip.clear();
+    }
+}
+
 /* Implementation of "Session" structure */
 
-Session::Session(const std::string token) : token(token)
+Session::Session(const std::string token) :
+    response_close(false),
+    socket_fd(-1),
+    port(0),
+    length(0),
+    xml_cmd(NULL),
+    token(token),
+    connection(NULL),
+    chunked(false),
+    sid(-1),
+    cid(-1),
+    started(0),
+    queued(0),
+    firstByte(0),
+    binary(false),
+    payload(NULL),
+    payloadLength(0),
+    routing(-1),
+    xml(true),
+    priority(ActionPolicy::NORMAL)
+{
+    memset(&socketAddress, 0, sizeof(socketAddress));
+}
+Session::Session(Connection *_connection)
+{
+    reset(_connection);
+}
+Session::Session() :
+    response_close(false),
+    socket_fd(-1),
+    port(0),
+    length(0),
+    xml_cmd(NULL),
+    connection(NULL),
+    chunked(false),
+    sid(-1),
+    cid(-1),
+    started(0),
+    queued(0),
+    firstByte(0),
+    binary(false),
+    payload(NULL),
+    payloadLength(0),
+    routing(-1),
+    xml(true),
+    priority(ActionPolicy::NORMAL)
 {
+    memset(&socketAddress, 0, sizeof(socketAddress));
 }
 Session::Session(int sfd, struct sockaddr *_socketAddress) :
     socket_fd(sfd),
-    socketAddress(_socketAddress),
-    length(0)
+    length(0),
+    connection(NULL),
+    chunked(false),
+    sid(-1),
+    cid(-1),
+    started(0),
+    queued(0),
+    firstByte(0),
+    binary(false),
+    payload(NULL),
+    payloadLength(0),
+    routing(-1),
+    xml(true),
+    priority(ActionPolicy::NORMAL)
 {
-    char _ip[INET_ADDRSTRLEN];
+    char _ip[INET6_ADDRSTRLEN];
     void *address;
 
-    if (socketAddress->sa_family == AF_INET) {
-        address = &((struct sockaddr_in *) socketAddress)->sin_addr;
-        port = ntohs(((struct sockaddr_in *) socketAddress)->sin_port);
+    memset(&socketAddress, 0, sizeof(socketAddress));
+    if (_socketAddress->sa_family == AF_INET) {
+        memcpy(&socketAddress, _socketAddress, sizeof(struct sockaddr_in));
+        address = &((struct sockaddr_in *) &socketAddress)->sin_addr;
+        port = ntohs(((struct sockaddr_in *) &socketAddress)->sin_port);
     } else {
-        address = &((struct sockaddr_in6 *) socketAddress)->sin6_addr;
-        port = ntohs(((struct sockaddr_in6 *) socketAddress)->sin6_port);
-    }
-    /*
-     * TODO Change the first arguemt to commented arguemtn after
-     * deleting Unix socket
-     * */
-    inet_ntop(AF_INET, // socketAddress->sa_family,
-              address, _ip, INET_ADDRSTRLEN);
+        memcpy(&socketAddress, _socketAddress, sizeof(struct sockaddr_in6));
+        address = &((struct sockaddr_in6 *) &socketAddress)->sin6_addr;
+        port = ntohs(((struct sockaddr_in6 *) &socketAddress)->sin6_port);
+    }
+    inet_ntop(socketAddress.ss_family, address, _ip, sizeof(_ip));
     ip.assign(_ip);
 }
 
+void Session::reset(Connection *_connection)
+{
+    response_close = false;
+    socket_fd = _connection->socket_fd;
+    socketAddress = _connection->address;
+    ip = _connection->ip;
+    port = _connection->port;
+    length = 0;
+    xml_cmd = NULL;
+    _xml_cmd.clear();
+    token.clear();
+    connection = _connection;
+    tag.clear();
+    chunked = false;
+    sid = -1;
+    cid = -1;
+    started = Metrics::now();
+    queued = started;
+    firstByte = _connection->firstByte;
+    binary = false;
+    payload = NULL;
+    payloadLength = 0;
+    routing = -1;
+    xml = true;
+    priority = ActionPolicy::NORMAL;
+}
+
+/* Implementation of "ChunkWriter" class */
+
+class FireLoop::ChunkWriter : public ResponseWriter
+{
+public:
+    ChunkWriter(const Session *session) : session(session)
+    {
+    }
+
+    virtual void write(const char *data, size_t length)
+    {
+        size_t size;
+
+        while (length > 0) {
+            if (buffer.capacity() < CHUNK_SIZE)
+                buffer.reserve(CHUNK_SIZE);
+            size = std::min(length, CHUNK_SIZE - buffer.length());
+            buffer.append(data, size);
+            data += size;
+            length -= size;
+            if (buffer.length() == CHUNK_SIZE)
+                flush();
+        }
+    }
+
+    using ResponseWriter::write;
+
+    /**
+     * @brief Sends buffered data as a chunk, then waits while connection
+     * has too much queued output.
+     */
+    void flush()
+    {
+        Connection *connection = session->connection;
+        bool broken;
+
+        if (buffer.empty())
+            return;
+        writeFrame(session, buffer, true);
+        buffer.clear();
+
+        pthread_mutex_lock(&connection->writeLock);
+        while ((connection->outputBytes > MAX_OUTPUT) && ! connection->broken)
+            pthread_cond_wait(&connection->drained, &connection->writeLock);
+        broken = connection->broken;
+        pthread_mutex_unlock(&connection->writeLock);
+        if (broken)
+            throw Exception("Connection is broken", TracePoint("fireloop"));
+    }
+
+private:
+    /**
+     * @brief Session of streaming action.
+     */
+    const Session *session;
+
+    /**
+     * @brief Data not sent yet.
+     */
+    string buffer;
+};
+
+class FireLoop::Pending : public AsyncResult
+{
+public:
+    Pending(Session *session) : session(session), error(NULL)
+    {
+    }
+
+    virtual ~Pending()
+    {
+        delete error;
+    }
+
+    /**
+     * @brief Session of asynchronous action.
+     */
+    Session *session;
+
+    /**
+     * @brief Result of action, or its failure when not NULL.
+     */
+    string result;
+    Exception *error;
+
+protected:
+    virtual void resolved(const string &_result)
+    {
+        result = _result;
+        post();
+    }
+
+    virtual void rejected(const Exception &exception)
+    {
+        error = new Exception(exception);
+        post();
+    }
+
+private:
+    void post()
+    {
+        try {
+            session->connection->reactor->post(resume, this);
+        } catch (Exception &e) {
+            log << LogLevel::ERROR << "Can't resume session: " + e.xml();
+        }
+    }
+};
+
 /* Implementation of "FireLoop" class */
 
 void FireLoop::init()
@@ -118,212 +554,1385 @@ void FireLoop::set_unixSocket(string path)
 
 void FireLoop::set_bufSize(unsigned int size)
 {
-    bufSize = size;
+    /* Buffer must hold at least a complete frame header */
+    bufSize = (size > 2 * MAX_HEADER) ? size : 2 * MAX_HEADER;
+}
+
+void FireLoop::set_maxCommand(unsigned long length)
+{
+    maxCommand = length;
+}
+
+void FireLoop::set_workers(unsigned int number)
+{
+    workersNO = number;
+}
+
+void FireLoop::set_queueSize(unsigned int size)
+{
+    queueSize = size;
+}
+
+void FireLoop::set_queueTimeout(unsigned int timeout)
+{
+    queueTimeout = timeout;
+}
+
+void FireLoop::set_maxConnections(unsigned int number)
+{
+    maxConnections = number;
+}
+
+void FireLoop::set_maxSessions(unsigned int number)
+{
+    maxSessions = number;
+}
+
+void FireLoop::set_maxBytes(unsigned long bytes)
+{
+    maxBytes = bytes;
+}
+
+void FireLoop::set_maxQueued(unsigned int number)
+{
+    maxQueued = number;
+}
+
+void FireLoop::set_headerTimeout(unsigned int timeout)
+{
+    headerTimeout = timeout;
+}
+
+void FireLoop::set_bodyTimeout(unsigned int timeout)
+{
+    bodyTimeout = timeout;
+}
+
+void FireLoop::set_requestTimeout(unsigned int timeout)
+{
+    requestTimeout = timeout;
+}
+
+void FireLoop::set_reactors(unsigned int number)
+{
+    reactorsNO = (number > 0) ? number : 1;
+}
+
+WorkerPool::Stats FireLoop::get_poolStats()
+{
+    return workers.get_stats();
+}
+
+XParam::XInt FireLoop::get_statsSysID()
+{
+    return statsSysID;
+}
+
+void FireLoop::set_statsSysID(XParam::XInt sysID)
+{
+    statsSysID = sysID;
+}
+
+void FireLoop::set_statsEnabled(bool enable)
+{
+    statsEnabled = enable;
+}
+
+string FireLoop::get_stats()
+{
+    const char *lanes[ActionPolicy::PRIORITIES] = {"high", "normal", "low"};
+    WorkerPool::Stats pool = workers.get_stats();
+    vector<Metrics::Record> records = ActionRepository::get_metrics();
+    long connections = 0;
+    long sessions = 0;
+    unsigned long long accepted = 0;
+    unsigned long long bytesIn = 0;
+    unsigned long long bytesOut = 0;
+    unsigned long long frameErrors = 0;
+    unsigned long long parseErrors = 0;
+    unsigned long long timeouts = 0;
+    unsigned long long shed[4] = {0, 0, 0, 0};
+    ResponseCache::Stats cache = ActionRepository::get_cacheStats();
+    Gate::Stats lane;
+    string out;
+
+    for (unsigned int i = 0; (counters != NULL) && (i < reactorsNO); ++i) {
+        connections += counters[i].connections.load(std::memory_order_relaxed);
+        sessions += counters[i].sessions.load(std::memory_order_relaxed);
+        accepted += counters[i].accepted.load(std::memory_order_relaxed);
+        bytesIn += counters[i].bytesIn.load(std::memory_order_relaxed);
+        bytesOut += counters[i].bytesOut.load(std::memory_order_relaxed);
+        frameErrors += counters[i].frameErrors.load(std::memory_order_relaxed);
+        parseErrors += counters[i].parseErrors.load(std::memory_order_relaxed);
+        timeouts += counters[i].timeouts.load(std::memory_order_relaxed);
+        shed[0] += counters[i].shedConnections.load(std::memory_order_relaxed);
+        shed[1] += counters[i].shedSessions.load(std::memory_order_relaxed);
+        shed[2] += counters[i].shedBytes.load(std::memory_order_relaxed);
+        shed[3] += counters[i].shedQueued.load(std::memory_order_relaxed);
+    }
+
+    out.reserve(512 + records.size() * 1024);
+    out += "<stats><server";
+    attribute(out, "reactors", reactorsNO);
+    attribute(out, "connections", connections);
+    attribute(out, "sessions", sessions);
+    attribute(out, "accepted", accepted);
+    attribute(out, "bytesIn", bytesIn);
+    attribute(out, "bytesOut", bytesOut);
+    attribute(out, "frameErrors", frameErrors);
+    attribute(out, "parseErrors", parseErrors);
+    attribute(out, "timeouts", timeouts);
+    out += "/><admission";
+    attribute(out, "maxConnections", maxConnections);
+    attribute(out, "maxSessions", maxSessions);
+    attribute(out, "maxBytes", maxBytes);
+    attribute(out, "maxQueued", maxQueued);
+    attribute(out, "bytesInflight", (counters != NULL) ? total(&Counters::bytesInflight) : 0);
+    attribute(out, "shedConnections", shed[0]);
+    attribute(out, "shedSessions", shed[1]);
+    attribute(out, "shedBytes", shed[2]);
+    attribute(out, "shedQueued", shed[3]);
+    out += "/><workers";
+    attribute(out, "threads", pool.threads);
+    attribute(out, "queueSize", pool.queueSize);
+    attribute(out, "queued", pool.queued);
+    attribute(out, "maxQueued", pool.maxQueued);
+    attribute(out, "busy", pool.busy);
+    attribute(out, "submitted", pool.submitted);
+    attribute(out, "rejected", pool.rejected);
+    attribute(out, "avgWait", pool.submitted ? pool.totalWait / pool.submitted : 0);
+    attribute(out, "maxWait", pool.maxWait);
+    out += "/><lanes>";
+    for (int i = 0; i < ActionPolicy::PRIORITIES; ++i) {
+        lane = ActionRepository::get_laneStats((ActionPolicy::Priority) i);
+        out += "<lane";
+        attribute(out, "priority", lanes[i]);
+        attribute(out, "limit", lane.limit);
+        attribute(out, "running", lane.running);
+        attribute(out, "queued", pool.laneQueued[i]);
+        attribute(out, "rejected", lane.rejected);
+        out += "/>";
+    }
+    out += "</lanes><cache";
+    attribute(out, "entries", cache.entries);
+    attribute(out, "hits", cache.hits);
+    attribute(out, "misses", cache.misses);
+    attribute(out, "coalesced", cache.coalesced);
+    out += "/><actions>";
+    for (size_t i = 0; i < records.size(); ++i) {
+        out += "<action";
+        if (records[i].sid == Metrics::UNKNOWN)
+            attribute(out, "module", "unknown");
+        else {
+            attribute(out, "sid", std::to_string(records[i].sid));
+            attribute(out, "cid", std::to_string(records[i].cid));
+        }
+        if (stats(records[i].sid))
+            attribute(out, "module", "fireloop");
+        else if (! records[i].module.empty())
+            attribute(out, "module", records[i].module);
+        if (! records[i].action.empty())
+            attribute(out, "name", records[i].action);
+        for (int c = 0; c < Metrics::COUNTERS; ++c)
+            attribute(out, Metrics::counterString[c].c_str(), records[i].counters[c]);
+        out += ">";
+        for (int p = 0; p < Metrics::PHASES; ++p) {
+            const Metrics::Summary &phase = records[i].phases[p];
+
+            if (phase.count == 0)
+                continue;
+            out += "<phase";
+            attribute(out, "name", Metrics::phaseString[p]);
+            attribute(out, "count", phase.count);
+            attribute(out, "avg", phase.total / phase.count);
+            attribute(out, "p50", phase.p50);
+            attribute(out, "p90", phase.p90);
+            attribute(out, "p99", phase.p99);
+            attribute(out, "p999", phase.p999);
+            attribute(out, "max", phase.max);
+            out += "/>";
+        }
+        out += "</action>";
+    }
+    out += "</actions></stats>";
+
+    return out;
+}
+
+std::future<string> FireLoop::submit(XParam::XInt sid, XParam::XInt cid,
+                                     ActionSource::Type source, const XParam::XmlNode *rnode,
+                                     const string &token)
+{
+    Call *call = new Call(sid, cid, source, token);
+
+    call->rnode = rnode;
+
+    return submit(call);
+}
+
+std::future<string> FireLoop::submit(XParam::XInt sid, XParam::XInt cid,
+                                     ActionSource::Type source, const string &payload, bool xml,
+                                     const string &token)
+{
+    Call *call = new Call(sid, cid, source, token);
+
+    call->payload = payload;
+    call->xml = xml;
+    call->session.payload = call->payload.data();
+    call->session.payloadLength = call->payload.length();
+
+    return submit(call);
+}
+
+std::future<string> FireLoop::submit(Call *call)
+{
+    std::future<string> result = call->result.get_future();
+    ActionPolicy policy;
+    ActionPolicy::Priority priority = ActionPolicy::NORMAL;
+
+    if (stats(call->session.sid))
+        priority = ActionPolicy::HIGH;
+    else if (ActionRepository::get_policy(call->session.sid, call->session.cid, policy))
+        priority = policy.priority;
+    /* Same limits as commands of users; counted on the first reactor */
+    call->session.length = call->payload.length();
+    if ((counters == NULL) || ! admit(&counters[0], call->session.length)) {
+        busy(call);
+
+        return result;
+    }
+    counters[0].sessions.fetch_add(1, std::memory_order_relaxed);
+    counters[0].bytesInflight.fetch_add(call->session.length, std::memory_order_relaxed);
+    call->session.queued = Metrics::now();
+    /* Caller never waits for a full workers queue */
+    if (! workers.offer(runCall, call, priority)) {
+        counters[0].shedQueued.fetch_add(1, std::memory_order_relaxed);
+        counters[0].sessions.fetch_sub(1, std::memory_order_relaxed);
+        counters[0].bytesInflight.fetch_sub(call->session.length, std::memory_order_relaxed);
+        busy(call);
+    }
+
+    return result;
+}
+
+void FireLoop::busy(Call *call)
+{
+    try {
+        throw Exception("Server is busy", TracePoint("fireloop"));
+    } catch (Exception &e) {
+        call->result.set_exception(std::current_exception());
+    }
+    delete call;
+}
+
+void FireLoop::runCall(void *_call)
+{
+    Call *call = static_cast<Call *>(_call);
+    Session *session = &call->session;
+    const XParam::XmlNode *rnode = call->rnode;
+    XParam::XmlParser &parser = *get_worker()->parser;
+    ActionPolicy policy;
+    unsigned long long fired = Metrics::now();
+
+    Metrics::record(session->sid, session->cid, Metrics::QUEUE, fired - session->queued);
+    try {
+        if (! stats(session->sid) &&
+            ActionRepository::get_policy(session->sid, session->cid, policy)) {
+            /* Like fire(), not parsed when it has waited too long */
+            if ((policy.queueTimeout > 0) &&
+                (fired - session->queued > policy.queueTimeout * 1000000ULL)) {
+                Metrics::count(session->sid, session->cid, Metrics::REJECTED);
+                throw Exception("Server is busy", TracePoint("fireloop"));
+            }
+            if ((rnode == NULL) && call->xml && policy.parse) {
+                parser.parse_memory(call->payload);
+                rnode = parser.get_document()->get_root_node();
+                Metrics::record(session->sid, session->cid, Metrics::PARSE,
+                                Metrics::now() - fired);
+            }
+        }
+        if (stats(session->sid))
+            call->result.set_value(runStats(session->cid));
+        else
+            call->result.set_value(
+                ActionRepository::runCmd(session->sid, session->cid, call->source, rnode, session,
+                                         session->token));
+    } catch (...) {
+        call->result.set_exception(std::current_exception());
+    }
+    if (call->payload.length() > MAX_RETAINED) {
+        delete get_worker()->parser;
+        get_worker()->parser = new XParam::XmlParser;
+    }
+    counters[0].sessions.fetch_sub(1, std::memory_order_relaxed);
+    counters[0].bytesInflight.fetch_sub(session->length, std::memory_order_relaxed);
+    delete call;
 }
 
 void FireLoop::loop()
 {
-    EPoll epoll;
     const gid_t PVM_GROUP_ID = 3000;
+    vector<pthread_t> threads;
+    pthread_t threadID;
+    void *memory;
     tcpSocket.setAddr(std::make_pair(ip, port));
     unixSocket.setAddr(unixSocketPath);
 
-    try {
-        tcpSocket.bind();
-    } catch (Exception &e) {
-        EXIT_FUNCTION_THROW_EXCEPTION(e);
+    /* Multiple reactors open their own SO_REUSEPORT listeners */
+    if (reactorsNO == 1) {
+        try {
+            tcpSocket.bind();
+            if (port == 0)
+                port = localPort(tcpSocket.get_fd());
+        } catch (Exception &e) {
+            EXIT_FUNCTION_THROW_EXCEPTION(e);
+        }
     }
 
     try {
         unixSocket.bind();
     } catch (Exception &e) {
-        tcpSocket.close();
+        if (reactorsNO == 1)
+            tcpSocket.close();
         EXIT_FUNCTION_THROW_EXCEPTION(e);
     }
 
+    /* Shed commands are answered with a response built once */
+    busyResponse.clear();
+    Response::serialize(busyResponse, ResponseStatus::FAILED,
+                        Exception("Server is busy", TracePoint("fireloop")).xml());
+    busyFrame = std::to_string(busyResponse.length()) + ":" + busyResponse;
+
     chown(unixSocket.get_unixAddr().c_str(), 0, PVM_GROUP_ID);
     ::chmod(unixSocket.get_unixAddr().c_str(), 0664);
 
+    Metrics::set_known(known);
+    reactors = new Reactor[reactorsNO];
+    if (posix_memalign(&memory, 64, reactorsNO * sizeof(Counters)) != 0)
+        EXIT_FUNCTION_THROW_EXCEPTION(Exception("Out of memory", TracePoint("fireloop")));
+    counters = static_cast<Counters *>(memory);
+    for (unsigned int i = 0; i < reactorsNO; ++i)
+        new (&counters[i]) Counters();
+    pools = new Pools[reactorsNO];
+    backlogs = new Backlog[reactorsNO];
+    tcpWatches = new Reactor::Watch[reactorsNO];
+    for (unsigned int i = 0; i < reactorsNO; ++i) {
+        tcpWatches[i].fd = -1;
+        backlogs[i].timer.task = retry;
+    }
     try {
-        tcpSocket.listen();
+        workers.start(workersNO, queueSize);
+
+        if (reactorsNO == 1)
+            tcpSocket.listen();
         unixSocket.listen();
 
-        epoll.create();
+        unixWatch.fd = unixSocket.get_fd();
+        unixWatch.handler = acceptSocket;
+        unixWatch.data = &unixWatch;
+        fcntl(unixWatch.fd, F_SETFL, fcntl(unixWatch.fd, F_GETFL) | O_NONBLOCK);
 
-        epoll.add(tcpSocket.get_fd(), EPoll::INPUT, acceptSocket, NULL);
+        for (unsigned int i = 0; i < reactorsNO; ++i) {
+            reactors[i].create();
 
-        epoll.add(unixSocket.get_fd(), EPoll::INPUT, acceptSocket, NULL);
+            if (reactorsNO == 1) {
+                tcpWatches[i].fd = tcpSocket.get_fd();
+                fcntl(tcpWatches[i].fd, F_SETFL, fcntl(tcpWatches[i].fd, F_GETFL) | O_NONBLOCK);
+            } else
+                tcpWatches[i].fd = listenReusePort();
+            tcpWatches[i].handler = acceptSocket;
+            tcpWatches[i].data = &tcpWatches[i];
+            reactors[i].add(&tcpWatches[i], Reactor::INPUT);
+
+            /* Only one of reactors is woken up per UNIX connection */
+            reactors[i].add(&unixWatch, Reactor::INPUT | Reactor::EXCLUSIVE);
+        }
 
-        while (true) {
-            epoll.wait();
+        if (reactorsNO == 1) {
+            PLogger::threadInfo(ACTREPO_MODULE, "reactor");
+            reactors[0].run();
+        } else {
+            for (unsigned long i = 0; i < reactorsNO; ++i) {
+                if (pthread_create(&threadID, NULL, runReactor, (void *) i))
+                    throw Exception(string("Failed to create reactor - ") + strerror(errno),
+                                    TracePoint("fireloop"));
+                threads.push_back(threadID);
+            }
+            for (unsigned int i = 0; i < threads.size(); ++i)
+                pthread_join(threads[i], NULL);
+            throw Exception("All reactors are stopped", TracePoint("fireloop"));
         }
 
     } catch (Exception &e) {
-        tcpSocket.close();
+        if (reactorsNO == 1)
+            tcpSocket.close();
+        else {
+            for (unsigned int i = 0; i < reactorsNO; ++i)
+                if (tcpWatches[i].fd != -1)
+                    close(tcpWatches[i].fd);
+        }
         unixSocket.close();
         EXIT_FUNCTION_THROW_EXCEPTION(e);
     }
 }
 
-void FireLoop::acceptSocket(EPoll::Data *epollData, void *data)
+int FireLoop::localPort(int listener)
 {
-    int socketDescriptor;
-    pthread_attr_t threadAttribute;
-    pthread_t threadID;
-    Session *session;
-    socklen_t socketLength;
-    struct sockaddr clientAddress;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
 
-    if (! (epollData->events & EPoll::INPUT))
-        return;
+    if (getsockname(listener, (struct sockaddr *) &address, &length) == -1)
+        throw Exception(string("getsockname: ") + strerror(errno), TracePoint("fireloop"));
+    if (address.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *) &address)->sin6_port);
 
-    if (pthread_attr_init(&threadAttribute) != 0) {
-        log << LogLevel::ERROR << string("pthread_attr_init: ") + strerror(errno);
+    return ntohs(((struct sockaddr_in *) &address)->sin_port);
+}
 
-        return;
-    }
-    pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_DETACHED);
-    socketLength = sizeof(clientAddress);
-    socketDescriptor = accept4(epollData->fileDescriptor, &clientAddress, &socketLength,
-                               SOCK_CLOEXEC);
-    if (socketDescriptor == -1) {
-        log << LogLevel::ERROR << string("Failed to accpet connection - ") + strerror(errno);
+int FireLoop::listenReusePort()
+{
+    int listener;
+    int enable = 1;
+    struct sockaddr_in address;
 
-        return;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &address.sin_addr) != 1)
+        throw Exception("Bad listen address: " + ip, TracePoint("fireloop"));
+
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+        throw Exception(string("socket: ") + strerror(errno), TracePoint("fireloop"));
+    if ((setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) ||
+        (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) ||
+        (::bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1) ||
+        (::listen(listener, SOMAXCONN) == -1)) {
+        string error = strerror(errno);
+
+        close(listener);
+        throw Exception("Can't listen on " + ip + ": " + error, TracePoint("fireloop"));
     }
-    try {
-        session = new Session(socketDescriptor, &clientAddress);
-        if (epollData->fileDescriptor == unixSocket.get_fd())
-            session->response_close = false;
-        else if (epollData->fileDescriptor == tcpSocket.get_fd())
-            session->response_close = false;
-        if (pthread_create(&threadID, &threadAttribute, fire, session)) {
-            log << LogLevel::ERROR << string("Failed to create thread - ") + strerror(errno);
-            close(socketDescriptor);
-            delete session;
+    /* Listeners of other reactors share the port picked for first one */
+    if (port == 0) {
+        try {
+            port = localPort(listener);
+        } catch (Exception &e) {
+            close(listener);
+            throw;
         }
-    } catch (std::bad_alloc &exception) {
-        log << LogLevel::ERROR << "Can't allocate session !";
-        close(socketDescriptor);
     }
+
+    return listener;
 }
 
-void *FireLoop::fire(void *_session)
+void *FireLoop::runReactor(void *_index)
 {
-    string response;
-    string xmlCommand;
-    Cmd command;
-    EPoll epoll;
-    Session *session = static_cast<Session *>(_session);
-    XParam::XmlParser parser;
+    unsigned long index = (unsigned long) _index;
+    unsigned int cpu;
+    unsigned int allowed;
+    cpu_set_t cpus;
+    cpu_set_t pin;
 
-    PLogger::threadInfo(ACTREPO_MODULE, "fire");
-    PLogger::setMode(plogger::ThreadRecorder::TRM_REAL);
-    PLOG(Severity::VERBOSE, ELogID::L_CLIENT_CONNECTED, session->ip.c_str(), session->port);
-    epoll.create();
-    try {
-        epoll.add(session->socket_fd, EPoll::INPUT, processSocket, _session);
-        do {
-            if (! epoll.wait())
+    /* Pin "index"th reactor on "index"th allowed cpu */
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        allowed = index % CPU_COUNT(&cpus);
+        for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &cpus) && (allowed-- == 0))
                 break;
-        } while (! session->response_close);
-    } catch (Exception &e) {
-        answer_failed(session, e);
-        PLOG(Severity::DEBUG, plogger::ELogID::L_INTERNAL_ERROR, e.xml().c_str());
-        goto finalize;
+        }
+        CPU_ZERO(&pin);
+        CPU_SET(cpu, &pin);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(pin), &pin) != 0)
+            log << LogLevel::ERROR << "Can't pin reactor on cpu " + std::to_string(cpu);
     }
-#ifdef __DEBUG__
-    PLOG(Severity::VERBOSE, ELogID::L_FIRE_CALLED, session->_xml_cmd);
-#endif
+
+    PLogger::threadInfo(ACTREPO_MODULE, "reactor");
     try {
-        command.loadXmlStr(session->_xml_cmd, &parser);
-        PLOG(Severity::VERBOSE, ELogID::L_USER_COMMAND, command.get_sysID(), command.get_cmdID());
-        PLogger::threadInfo(plogger::ThreadInfo::TI_TOKEN, command.get_token());
-        session->token = command.get_token();
-        response = ActionRepository::runCmd(command.get_sysID(), command.get_cmdID(),
-                                            ActionSource::FIRELOOP,
-                                            parser.get_document()->get_root_node(), session);
-        answer_ok(session, response);
-    } catch (Exception &exception) {
-        answer_failed(session, exception);
-        PLOG(Severity::DEBUG, plogger::ELogID::L_INTERNAL_ERROR, exception.xml().c_str());
-    } catch (std::exception &exception) {
-        Exception _exception(exception.what(), TracePoint("fireloop"));
-        answer_failed(session, _exception);
-        PLOG(Severity::DEBUG, plogger::ELogID::L_INTERNAL_ERROR, _exception.xml().c_str());
+        reactors[index].run();
+    } catch (Exception &e) {
+        log << LogLevel::ERROR << "Reactor stopped: " + e.xml();
+        /* Let kernel hand its TCP connections to other reactors */
+        reactors[index].remove(&tcpWatches[index]);
+        close(tcpWatches[index].fd);
+        tcpWatches[index].fd = -1;
     }
-
-finalize:
-    //	epollData->remove = true;
-    shutdown(session->socket_fd, SHUT_RDWR);
-    close(session->socket_fd);
-    PLOG(Severity::VERBOSE, ELogID::L_CLIENT_DISCONNECTED, session->ip.c_str(), session->port);
-    delete session;
-
     PLogger::threadExit();
-    pthread_exit(NULL);
+
+    return NULL;
 }
 
-void FireLoop::processSocket(EPoll::Data *epollData, void *data)
+void FireLoop::acceptSocket(Reactor *reactor, unsigned int events, void *data)
 {
-    char *buffer;
-    char *endPointer;
-    int bufferSize = 1024;
-    int bytesRead;
-    size_t position;
-    string message;
-    Session *session = static_cast<Session *>(data);
+    int socketDescriptor;
+    Connection *connection;
+    socklen_t socketLength;
+    Reactor::Watch *listener = static_cast<Reactor::Watch *>(data);
+    Pools &pool = pools[reactor - reactors];
+
+    if (! (events & Reactor::INPUT))
+        return;
+
+    /* Past connections limit, answer busy and close at once; best effort,
+     * the socket isn't watched.
+     */
+    if ((maxConnections > 0) && (total(&Counters::connections) >= (long) maxConnections)) {
+        socketDescriptor = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (socketDescriptor != -1) {
+            send(socketDescriptor, busyFrame.data(), busyFrame.length(), MSG_NOSIGNAL);
+            close(socketDescriptor);
+            counters[reactor - reactors].shedConnections.fetch_add(1, std::memory_order_relaxed);
+        }
 
-    if (! (epollData->events & EPoll::INPUT))
         return;
+    }
 
     try {
-        buffer = new char[bufferSize + 1];
+        connection = pool.connections.get();
     } catch (std::bad_alloc &exception) {
-        log << LogLevel::ERROR << "Can't allocate buffer!";
-        fire_failed(session, "Can't allocate buffer!");
+        log << LogLevel::ERROR << "Can't allocate connection !";
+        /* Drop the connection, so that it isn't reported again */
+        socketDescriptor = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (socketDescriptor != -1)
+            close(socketDescriptor);
 
         return;
     }
-    if ((bytesRead = read(epollData->fileDescriptor, buffer, bufferSize)) > 0) {
-        /* An error occurred */
-        if (bytesRead == -1) {
-            log << LogLevel::ERROR << "Failed to read data: " + string(strerror(errno));
-            epollData->remove = true;
-            delete buffer;
+    /* Peer address is stored in connection, which owns it */
+    socketLength = sizeof(connection->address);
+    socketDescriptor = accept4(listener->fd, (struct sockaddr *) &connection->address,
+                               &socketLength, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (socketDescriptor == -1) {
+        if ((errno != EAGAIN) && (errno != EINTR))
+            log << LogLevel::ERROR << string("Failed to accpet connection - ") + strerror(errno);
+        pool.connections.put(connection);
 
-            return;
+        return;
+    }
+    try {
+        connection->open(socketDescriptor, bufSize);
+    } catch (std::bad_alloc &exception) {
+        log << LogLevel::ERROR << "Can't allocate connection !";
+        close(socketDescriptor);
+        pool.connections.put(connection);
+
+        return;
+    }
+    connection->reactor = reactor;
+    connection->counters = &counters[reactor - reactors];
+    connection->watch.fd = socketDescriptor;
+    connection->watch.handler = processSocket;
+    connection->watch.data = connection;
+    connection->timer.task = expire;
+    connection->timer.data = connection;
+    try {
+        reactor->add(&connection->watch, Reactor::INPUT | Reactor::HANGUP | Reactor::ONESHOT);
+        connection->armedEvents = Reactor::INPUT | Reactor::HANGUP;
+    } catch (Exception &e) {
+        log << LogLevel::ERROR << "Can't watch connection socket: " + e.xml();
+        close(socketDescriptor);
+        pool.connections.put(connection);
+
+        return;
+    }
+    connection->counters->accepted.fetch_add(1, std::memory_order_relaxed);
+    connection->counters->connections.fetch_add(1, std::memory_order_relaxed);
+    /* Connection must send its first header in time */
+    armDeadline(connection, false);
+    PLOG(Severity::VERBOSE, ELogID::L_CLIENT_CONNECTED, connection->ip.c_str(), connection->port);
+}
+
+void FireLoop::fire(void *_session)
+{
+    string response;
+    Session *session = static_cast<Session *>(_session);
+    Worker *worker = get_worker();
+    XParam::XmlParser &parser = *worker->parser;
+    const XParam::XmlNode *rnode = NULL;
+    ActionPolicy policy;
+    Pending *pending;
+    bool async = false;
+    bool started = false;
+    size_t length = session->_xml_cmd.length();
+    unsigned long long fired = Metrics::now();
+    bool parsed = false;
+    Tracer::Timeline timeline;
+
+    memset(&timeline, 0, sizeof(timeline));
+
+#ifdef __DEBUG__
+    PLOG(Severity::VERBOSE, ELogID::L_FIRE_CALLED, session->_xml_cmd);
+#endif
+    try {
+        /* Routed on reactor (route()); the tree is built only for actions
+         * that read it.
+         */
+        switch (session->routing) {
+        case PRESCAN_ROUTED:
+            break;
+        case PRESCAN_MALFORMED:
+            throw Exception(session->binary ? "Malformed binary command" : "Malformed command",
+                            TracePoint("fireloop"));
+        default: {
+            /* Rare; a fresh Cmd leaves no field of previous command behind */
+            Cmd command;
+
+            command.loadXmlStr(session->_xml_cmd, &parser);
+            rnode = parser.get_document()->get_root_node();
+            session->sid = command.get_sysID();
+            session->cid = command.get_cmdID();
+            session->token = command.get_token();
+            break;
+        }
+        }
+        if (! stats(session->sid) &&
+            ActionRepository::get_policy(session->sid, session->cid, policy, async)) {
+            /* Not parsed at all, when it has waited too long for a worker */
+            if ((policy.queueTimeout > 0) &&
+                (fired - session->queued > policy.queueTimeout * 1000000ULL)) {
+                parsed = true;
+                Metrics::count(session->sid, session->cid, Metrics::REJECTED);
+                throw Exception("Server is busy", TracePoint("fireloop"));
+            }
+            if ((rnode == NULL) && policy.parse && session->xml) {
+                parser.parse_memory_raw((const unsigned char *) session->payload,
+                                        session->payloadLength);
+                rnode = parser.get_document()->get_root_node();
+            }
         }
-        /* The device is disconnected */
-        if (bytesRead == 0) {
-            epollData->remove = true;
-            delete buffer;
+        parsed = true;
+        Metrics::record(session->sid, session->cid, Metrics::READ,
+                        session->queued - session->started);
+        Metrics::record(session->sid, session->cid, Metrics::QUEUE, fired - session->queued);
+        timeline.parsed = Metrics::now();
+        Metrics::record(session->sid, session->cid, Metrics::PARSE, timeline.parsed - fired);
+        PLOG(Severity::VERBOSE, ELogID::L_USER_COMMAND, session->sid, session->cid);
+        /* Token is logged only when every run is traced (debug builds) */
+        if (ActionList::get_traceLevel() == ActionList::TRACE_ALL)
+            PLogger::threadInfo(plogger::ThreadInfo::TI_TOKEN, session->token);
+        timeline.actionStart = Metrics::now();
+        /* Unroutable commands are rejected by ActionRepository, before any
+         * action reads "rnode".
+         */
+        if (stats(session->sid))
+            response = runStats(session->cid);
+        else if (async || ((policy.cacheTTL > 0) && ! session->chunked)) {
+            /* A cached command coalesced with an identical one is completed
+             * by it.
+             */
+            pending = new Pending(session);
+            try {
+                started = ActionRepository::startCmd(session->sid, session->cid,
+                                                     ActionSource::FIRELOOP, rnode, session,
+                                                     pending, session->token);
+            } catch (...) {
+                delete pending;
+                throw;
+            }
+            if (! started) {
+                /* Action list is replaced meanwhile */
+                delete pending;
+                response = ActionRepository::runCmd(session->sid, session->cid,
+                                                    ActionSource::FIRELOOP, rnode, session,
+                                                    session->token);
+            }
+        } else if (session->chunked) {
+            ChunkWriter writer(session);
 
-            return;
+            ActionRepository::streamCmd(session->sid, session->cid, ActionSource::FIRELOOP, rnode,
+                                        session, &writer, session->token);
+            writer.flush();
+        } else
+            response = ActionRepository::runCmd(session->sid, session->cid,
+                                                ActionSource::FIRELOOP, rnode, session,
+                                                session->token);
+        timeline.actionEnd = Metrics::now();
+        if (! started)
+            answer_ok(session, response);
+    } catch (Exception &exception) {
+        timeline.failed = true;
+        if (! parsed) {
+            Metrics::count(session->sid, session->cid, Metrics::ERRORS);
+            session->connection->counters->parseErrors.fetch_add(1, std::memory_order_relaxed);
         }
-        buffer[bytesRead] = '\0';
-        message.assign(buffer);
-        if (! session->length) {
-            position = message.find(':');
-            if ((position != string::npos) && (position < 7)) {
-                session->length = strtoul(message.substr(0, position).c_str(), &endPointer, 10);
-                message.erase(0, position + 1);
-            } else {
-                session->response_close = true;
-                log << LogLevel::ERROR
-                    << "Failed to get the length of "
-                       "the command or the length is too big";
-                delete buffer;
+        answer_failed(session, exception);
+        PLOG(Severity::DEBUG, plogger::ELogID::L_INTERNAL_ERROR, exception.xml().c_str());
+    } catch (std::exception &exception) {
+        Exception _exception(exception.what(), TracePoint("fireloop"));
+        timeline.failed = true;
+        if (! parsed) {
+            Metrics::count(session->sid, session->cid, Metrics::ERRORS);
+            session->connection->counters->parseErrors.fetch_add(1, std::memory_order_relaxed);
+        }
+        answer_failed(session, _exception);
+        PLOG(Severity::DEBUG, plogger::ELogID::L_INTERNAL_ERROR, _exception.xml().c_str());
+    }
+    /* Don't hold tree of a large command until next one */
+    if (length > MAX_RETAINED) {
+        delete worker->parser;
+        worker->parser = new XParam::XmlParser;
+    }
+    /* Session is resumed by reactor, maybe already */
+    if (started)
+        return;
+    timeline.written = Metrics::now();
+    if (Tracer::sampled(timeline.written - session->firstByte)) {
+        timeline.sid = session->sid;
+        timeline.cid = session->cid;
+        strncpy(timeline.tag, session->tag.c_str(), sizeof(timeline.tag) - 1);
+        timeline.accepted = session->connection->accepted;
+        timeline.firstByte = session->firstByte;
+        timeline.framed = session->queued;
+        Tracer::record(timeline);
+    }
+
+    try {
+        session->connection->reactor->post(complete, session);
+    } catch (Exception &e) {
+        log << LogLevel::ERROR << "Can't complete session: " + e.xml();
+    }
+}
+
+void FireLoop::processSocket(Reactor *reactor, unsigned int events, void *data)
+{
+    ssize_t bytesRead;
+    Connection *connection = static_cast<Connection *>(data);
+    Session *session = connection->reading;
+
+    /* One-shot watch is disarmed now */
+    connection->armedEvents = 0;
+    if (events & Reactor::OUTPUT)
+        flushOutput(connection);
+    if (connection->closing || connection->blocked ||
+        ! (events & (Reactor::INPUT | Reactor::HANGUP | Reactor::ERROR))) {
+        dispatch(connection);
+
+        return;
+    }
+    if (session) {
+        /* Read command body straight into its final storage, which grows
+         * as body arrives, up to its length.
+         */
+        if (connection->received == session->_xml_cmd.length()) {
+            try {
+                session->_xml_cmd.resize(std::min<unsigned long>(
+                    session->length,
+                    std::max<unsigned long>(2 * connection->received,
+                                            connection->received + bufSize)));
+            } catch (std::bad_alloc &exception) {
+                log << LogLevel::ERROR << "Can't allocate session !";
+                connection->closing = true;
+                dispatch(connection);
 
                 return;
             }
         }
-        session->_xml_cmd += message;
-        session->length -= message.length();
+        bytesRead = read(connection->socket_fd, &session->_xml_cmd[connection->received],
+                         session->_xml_cmd.length() - connection->received);
+        if (bytesRead > 0) {
+            connection->received += bytesRead;
+            connection->counters->bytesIn.fetch_add(bytesRead, std::memory_order_relaxed);
+        }
+    } else {
+        bytesRead = read(connection->socket_fd, &connection->input[connection->inputEnd],
+                         connection->input.size() - connection->inputEnd);
+        if (bytesRead > 0) {
+            if (connection->inputBegin == connection->inputEnd)
+                connection->firstByte = Metrics::now();
+            connection->inputEnd += bytesRead;
+            connection->counters->bytesIn.fetch_add(bytesRead, std::memory_order_relaxed);
+        }
+    }
+    /* An error occurred */
+    if (bytesRead == -1) {
+        if ((errno != EAGAIN) && (errno != EINTR)) {
+            log << LogLevel::ERROR << "Failed to read data: " + string(strerror(errno));
+            connection->closing = true;
+        }
+    }
+    /* The device is disconnected; commands read so far are still answered */
+    if (bytesRead == 0)
+        connection->closing = true;
+    dispatch(connection);
+}
+
+void FireLoop::dispatch(Connection *connection)
+{
+    Session *session;
+    int header;
+    unsigned long available;
+    const char *input;
+    FrameHeader frame;
+    bool waiting = false;
+    bool framed = false;
+
+    while (true) {
+        if (connection->reading) {
+            session = connection->reading;
+            /* Command body is not complete yet */
+            if (connection->received < session->length)
+                break;
+            connection->reading = NULL;
+            schedule(session);
+            continue;
+        }
+        if (connection->discard > 0) {
+            /* Skip body of a shed command */
+            available = connection->inputEnd - connection->inputBegin;
+            if (available > connection->discard)
+                available = connection->discard;
+            connection->inputBegin += available;
+            connection->discard -= available;
+            if (connection->discard > 0)
+                break;
+            continue;
+        }
+        input = &connection->input[connection->inputBegin];
+        header = parseFrame(input, connection->inputEnd - connection->inputBegin, frame);
+        if (header == -1) {
+            /* Its untagged error waits for responses in flight, like an
+             * untagged command.
+             */
+            if (connection->ordered || (connection->inflight > 0)) {
+                waiting = true;
+                break;
+            }
+            log << LogLevel::ERROR
+                << "Failed to get the length of "
+                   "the command or the length is too big";
+            connection->closing = true;
+            connection->inputBegin = connection->inputEnd = 0;
+            try {
+                session = newSession(connection);
+            } catch (std::bad_alloc &exception) {
+                break;
+            }
+            session->response_close = true;
+            connection->counters->frameErrors.fetch_add(1, std::memory_order_relaxed);
+            connection->counters->sessions.fetch_add(1, std::memory_order_relaxed);
+            connection->inflight++;
+            connection->ordered = true;
+            fire_failed(session, "Bad command frame");
+            break;
+        }
+        /* Frame header is not complete yet */
+        if (header == 0)
+            break;
+        /* Wait for commands in flight, so that untagged responses are
+         * sent in order.
+         */
+        if (connection->ordered ||
+            (frame.tag.empty() ? (connection->inflight > 0)
+                               : (connection->inflight >= MAX_PIPELINE))) {
+            waiting = true;
+            break;
+        }
+        available = connection->inputEnd - connection->inputBegin - header;
+        if (available > frame.length)
+            available = frame.length;
+        if (frame.keepAlive)
+            connection->keepAlive = true;
+        /* Past admission limits, answer at once; untagged commands in
+         * flight are done by now, so responses stay in order.
+         */
+        framed = true;
+        if (! admit(connection->counters, frame.length)) {
+            writeBusy(connection, frame.tag);
+            if (! connection->keepAlive) {
+                connection->closing = true;
+                connection->inputBegin = connection->inputEnd = 0;
+                break;
+            }
+            connection->inputBegin += header + available;
+            connection->discard = frame.length - available;
+            continue;
+        }
+        try {
+            session = newSession(connection);
+            /* The rest of body, if any, is read straight into it */
+            session->_xml_cmd.assign(input + header, available);
+        } catch (std::bad_alloc &exception) {
+            log << LogLevel::ERROR << "Can't allocate session !";
+            connection->closing = true;
+            break;
+        }
+        session->tag = frame.tag;
+        session->length = frame.length;
+        session->chunked = frame.chunked;
+        session->binary = frame.binary;
+        connection->inputBegin += header + available;
+        connection->counters->bytesInflight.fetch_add(frame.length, std::memory_order_relaxed);
+        /* Without keep-alive, connection carries just one command */
+        session->response_close = ! connection->keepAlive;
+        connection->reading = session;
+        connection->received = available;
+    }
+
+    /* Reuse the whole receive buffer for next headers */
+    if (connection->inputBegin == connection->inputEnd)
+        connection->inputBegin = connection->inputEnd = 0;
+    else if (connection->input.size() - connection->inputEnd < MAX_HEADER) {
+        memmove(&connection->input[0], &connection->input[connection->inputBegin],
+                connection->inputEnd - connection->inputBegin);
+        connection->inputEnd -= connection->inputBegin;
+        connection->inputBegin = 0;
+    }
+
+    connection->blocked = waiting;
+    if (connection->closing) {
+        /* Incomplete command would never be completed */
+        release(connection->reading);
+        connection->reading = NULL;
+    }
+    if (rearm(connection))
+        armDeadline(connection, framed);
+}
+
+bool FireLoop::rearm(Connection *connection)
+{
+    unsigned int events = 0;
+    bool pending;
+
+    pthread_mutex_lock(&connection->writeLock);
+    pending = ! connection->output.empty();
+    pthread_mutex_unlock(&connection->writeLock);
+
+    if (connection->closing && (connection->inflight == 0) && ! pending) {
+        closeConnection(connection);
+
+        return false;
+    }
+    if (! connection->closing && ! connection->blocked)
+        events |= Reactor::INPUT | Reactor::HANGUP;
+    if (pending)
+        events |= Reactor::OUTPUT;
+    if ((events == 0) || (events == connection->armedEvents))
+        return true;
+    try {
+        connection->reactor->modify(&connection->watch, events | Reactor::ONESHOT);
+        connection->armedEvents = events;
+    } catch (Exception &e) {
+        log << LogLevel::ERROR << "Can't watch connection socket: " + e.xml();
+        pthread_mutex_lock(&connection->writeLock);
+        connection->broken = true;
+        connection->output.clear();
+        connection->outputBytes = 0;
+        pthread_cond_broadcast(&connection->drained);
+        pthread_mutex_unlock(&connection->writeLock);
+        connection->closing = true;
+        release(connection->reading);
+        connection->reading = NULL;
+        if (connection->inflight == 0) {
+            closeConnection(connection);
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void FireLoop::armDeadline(Connection *connection, bool framed)
+{
+    Connection::Phase phase = Connection::IDLE;
+    unsigned long long now;
+    unsigned long long deadline = 0;
+    unsigned int timeout;
+
+    /* Connections that don't read now, or wait between commands, have no
+     * deadline.
+     */
+    if (connection->closing || connection->blocked)
+        phase = Connection::IDLE;
+    else if ((connection->reading != NULL) || (connection->discard > 0))
+        phase = Connection::BODY;
+    else if ((connection->inputBegin < connection->inputEnd) ||
+             (! connection->keepAlive && (connection->inflight == 0)))
+        phase = Connection::HEADER;
+    if (phase == Connection::IDLE) {
+        connection->phase = phase;
+        connection->reactor->cancel(&connection->timer);
+
+        return;
+    }
+    if ((phase == connection->phase) && ! framed)
+        return;
+
+    now = Metrics::now();
+    /* Only a body that follows its header continues a request */
+    if ((connection->phase != Connection::HEADER) || (phase != Connection::BODY))
+        connection->requestDeadline = requestTimeout ? now + requestTimeout * 1000000ULL : 0;
+    connection->phase = phase;
+    timeout = (phase == Connection::HEADER) ? headerTimeout : bodyTimeout;
+    if (timeout > 0)
+        deadline = now + timeout * 1000000ULL;
+    if ((connection->requestDeadline > 0) &&
+        ((deadline == 0) || (connection->requestDeadline < deadline)))
+        deadline = connection->requestDeadline;
+    if (deadline == 0) {
+        connection->reactor->cancel(&connection->timer);
+
+        return;
+    }
+    connection->reactor->schedule(&connection->timer,
+                                  (deadline > now) ? (deadline - now) / 1000000 : 0);
+}
+
+void FireLoop::expire(Reactor *reactor, void *data)
+{
+    Connection *connection = static_cast<Connection *>(data);
+
+    log << LogLevel::ERROR << "Request missed its deadline, connection is closed";
+    connection->counters->timeouts.fetch_add(1, std::memory_order_relaxed);
+    connection->closing = true;
+    connection->phase = Connection::IDLE;
+    connection->inputBegin = connection->inputEnd = 0;
+    connection->discard = 0;
+    release(connection->reading);
+    connection->reading = NULL;
+    /* Nothing more is sent either; peer is disconnected now, and socket is
+     * closed once commands in flight are done.
+     */
+    pthread_mutex_lock(&connection->writeLock);
+    connection->broken = true;
+    connection->output.clear();
+    connection->outputBytes = 0;
+    pthread_cond_broadcast(&connection->drained);
+    pthread_mutex_unlock(&connection->writeLock);
+    shutdown(connection->socket_fd, SHUT_RDWR);
+    rearm(connection);
+}
+
+bool FireLoop::flushOutput(Connection *connection)
+{
+    struct iovec buffers[MAX_IOVEC];
+    struct msghdr message;
+    std::deque<string>::iterator entry;
+    ssize_t bytesWritten;
+    size_t offset;
+    bool pending;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = buffers;
+    pthread_mutex_lock(&connection->writeLock);
+    while (! connection->output.empty()) {
+        message.msg_iovlen = 0;
+        offset = connection->outputOffset;
+        for (entry = connection->output.begin();
+             (entry != connection->output.end()) && (message.msg_iovlen < MAX_IOVEC); ++entry) {
+            buffers[message.msg_iovlen].iov_base = &(*entry)[offset];
+            buffers[message.msg_iovlen].iov_len = entry->length() - offset;
+            message.msg_iovlen++;
+            offset = 0;
+        }
+        bytesWritten = sendmsg(connection->socket_fd, &message, MSG_NOSIGNAL);
+        if (bytesWritten == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                connection->broken = true;
+                connection->output.clear();
+                connection->outputBytes = 0;
+            }
+            break;
+        }
+        /* Drop what is sent */
+        connection->counters->bytesOut.fetch_add(bytesWritten, std::memory_order_relaxed);
+        connection->outputBytes -= bytesWritten;
+        bytesWritten += connection->outputOffset;
+        while ((! connection->output.empty()) &&
+               ((size_t) bytesWritten >= connection->output.front().length())) {
+            bytesWritten -= connection->output.front().length();
+            connection->output.pop_front();
+        }
+        connection->outputOffset = bytesWritten;
+    }
+    pending = ! connection->output.empty();
+    /* Wake up streaming actions of connection */
+    if (connection->outputBytes <= MAX_OUTPUT)
+        pthread_cond_broadcast(&connection->drained);
+    pthread_mutex_unlock(&connection->writeLock);
+
+    return pending;
+}
+
+void FireLoop::watchOutput(Reactor *reactor, void *data)
+{
+    Connection *connection = static_cast<Connection *>(data);
+    unsigned int posted;
+
+    pthread_mutex_lock(&connection->writeLock);
+    posted = --connection->posted;
+    pthread_mutex_unlock(&connection->writeLock);
+    /* Connection is closed before task runs */
+    if (connection->released) {
+        if (posted == 0)
+            pools[reactor - reactors].connections.put(connection);
+
+        return;
+    }
+    rearm(connection);
+}
+
+void FireLoop::schedule(Session *session)
+{
+    Connection *connection = session->connection;
+    Backlog &backlog = backlogs[connection->reactor - reactors];
+
+    if (session->response_close) {
+        connection->closing = true;
+        connection->inputBegin = connection->inputEnd = 0;
+    }
+    connection->inflight++;
+    connection->counters->sessions.fetch_add(1, std::memory_order_relaxed);
+    if (session->tag.empty())
+        connection->ordered = true;
+    session->queued = Metrics::now();
+    route(session);
+    /* Reactor never waits for a full workers queue; the command is parked
+     * behind earlier parked ones of its priority, and retried.
+     */
+    if (backlog.sessions[session->priority].empty() &&
+        workers.offer(fire, session, session->priority))
+        return;
+    if (queueTimeout == 0) {
+        reject(session);
+
+        return;
+    }
+    try {
+        backlog.sessions[session->priority].push_back(session);
+    } catch (std::bad_alloc &exception) {
+        reject(session);
+
+        return;
+    }
+    connection->reactor->schedule(&backlog.timer, 0);
+}
+
+void FireLoop::route(Session *session)
+{
+    ActionPolicy policy;
+    long sid;
+    long cid;
+
+    session->payload = session->_xml_cmd.data();
+    session->payloadLength = session->_xml_cmd.length();
+    session->xml = true;
+    session->priority = ActionPolicy::NORMAL;
+    /* By binary envelope or by a pre-scan of command, without a tree */
+    if (session->binary)
+        session->routing = decodeBinary(session, session->xml) ? PRESCAN_ROUTED
+                                                               : PRESCAN_MALFORMED;
+    else {
+        session->routing = prescan(session->_xml_cmd, sid, cid, session->token);
+        if (session->routing == PRESCAN_ROUTED) {
+            session->sid = sid;
+            session->cid = cid;
+        }
+    }
+    /* Commands that need a full parse are queued as NORMAL ones */
+    if (session->routing != PRESCAN_ROUTED)
+        return;
+    if (stats(session->sid))
+        session->priority = ActionPolicy::HIGH;
+    else if (ActionRepository::get_policy(session->sid, session->cid, policy))
+        session->priority = policy.priority;
+}
+
+void FireLoop::retry(Reactor *reactor, void *data)
+{
+    Backlog &backlog = backlogs[reactor - reactors];
+    unsigned long long now = Metrics::now();
+    Session *session;
+    bool parked = false;
+
+    for (int priority = 0; priority < ActionPolicy::PRIORITIES; ++priority) {
+        std::deque<Session *> &sessions = backlog.sessions[priority];
+
+        while (! sessions.empty()) {
+            session = sessions.front();
+            if (! workers.offer(fire, session, session->priority)) {
+                if (now - session->queued < queueTimeout * 1000000ULL)
+                    break;
+                reject(session);
+            }
+            sessions.pop_front();
+        }
+        parked = parked || ! sessions.empty();
     }
-    if ((signed int) session->length <= 0)
-        session->response_close = true;
-    delete buffer;
+    if (! parked)
+        reactor->cancel(&backlog.timer);
+    else
+        reactor->schedule(&backlog.timer, 0);
+}
+
+void FireLoop::reject(Session *session)
+{
+    log << LogLevel::ERROR << "Workers queue is full, command rejected";
+    session->connection->counters->shedQueued.fetch_add(1, std::memory_order_relaxed);
+    writeBusy(session->connection, session->tag);
+    session->connection->reactor->post(complete, session);
+}
+
+bool FireLoop::admit(Counters *_counters, unsigned long length)
+{
+    std::atomic<unsigned long long> *shed = NULL;
+
+    if ((maxSessions > 0) && (total(&Counters::sessions) >= (long) maxSessions))
+        shed = &_counters->shedSessions;
+    else if ((maxBytes > 0) &&
+             ((unsigned long) total(&Counters::bytesInflight) + length > maxBytes))
+        shed = &_counters->shedBytes;
+    else if ((maxQueued > 0) && (workers.get_queued() >= maxQueued))
+        shed = &_counters->shedQueued;
+    if (shed == NULL)
+        return true;
+    shed->fetch_add(1, std::memory_order_relaxed);
+
+    return false;
+}
+
+long FireLoop::total(std::atomic<long> Counters::*counter)
+{
+    long sum = 0;
+
+    for (unsigned int i = 0; i < reactorsNO; ++i)
+        sum += (counters[i].*counter).load(std::memory_order_relaxed);
+
+    return sum;
+}
+
+int FireLoop::parseFrame(const char *input, size_t size, FrameHeader &frame)
+{
+    const char *end;
+    const char *position = input;
+    size_t digits;
+
+    end = static_cast<const char *>(memchr(input, ':', (size < MAX_HEADER) ? size : MAX_HEADER));
+    if (end == NULL)
+        return (size < MAX_HEADER) ? 0 : -1;
+
+    frame.binary = (end - input > (ptrdiff_t) sizeof(BINARY_MAGIC) - 1) &&
+                   (memcmp(input, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) == 0);
+    if (frame.binary)
+        position += sizeof(BINARY_MAGIC) - 1;
+    frame.length = 0;
+    for (digits = 0; (position < end) && isdigit((unsigned char) *position); ++position, ++digits)
+        frame.length = frame.length * 10 + (*position - '0');
+    if ((digits == 0) || (digits > 9) || (frame.length > maxCommand))
+        return -1;
+
+    frame.tag.clear();
+    frame.keepAlive = false;
+    frame.chunked = false;
+    while (position < end) {
+        if (*position++ != ';')
+            return -1;
+        if ((position < end) && (*position == 'k')) {
+            frame.keepAlive = true;
+            position++;
+        } else if ((position < end) && (*position == 'c')) {
+            frame.chunked = true;
+            position++;
+        } else if ((position < end) && (*position == 't')) {
+            const char *start = ++position;
+
+            while ((position < end) && (isalnum((unsigned char) *position) ||
+                                        (*position == '_') || (*position == '-')))
+                position++;
+            if ((position == start) || (position - start > 32))
+                return -1;
+            frame.tag.assign(start, position - start);
+        } else
+            return -1;
+    }
+
+    return end - input + 1;
+}
+
+void FireLoop::resume(Reactor *reactor, void *data)
+{
+    Pending *pending = static_cast<Pending *>(data);
+    Session *session = pending->session;
+
+    if (pending->error != NULL)
+        answer_failed(session, *pending->error);
+    else if (session->chunked) {
+        if (! pending->result.empty())
+            writeFrame(session, pending->result, true);
+        answer_ok(session, "");
+    } else
+        answer_ok(session, pending->result);
+    delete pending;
+    complete(reactor, session);
+}
+
+void FireLoop::complete(Reactor *reactor, void *data)
+{
+    Session *session = static_cast<Session *>(data);
+    Connection *connection = session->connection;
+
+    connection->inflight--;
+    connection->counters->sessions.fetch_sub(1, std::memory_order_relaxed);
+    if (session->tag.empty())
+        connection->ordered = false;
+    release(session);
+    /* A worker is free now; backlog timer is armed while any is parked */
+    if (backlogs[reactor - reactors].timer.list != NULL)
+        retry(reactor, NULL);
+    dispatch(connection);
+}
+
+void FireLoop::closeConnection(Connection *connection)
+{
+    connection->counters->connections.fetch_sub(1, std::memory_order_relaxed);
+    connection->reactor->cancel(&connection->timer);
+    connection->reactor->remove(&connection->watch);
+    shutdown(connection->socket_fd, SHUT_RDWR);
+    close(connection->socket_fd);
+    PLOG(Severity::VERBOSE, ELogID::L_CLIENT_DISCONNECTED, connection->ip.c_str(),
+         connection->port);
+    release(connection);
+}
+
+Session *FireLoop::newSession(Connection *connection)
+{
+    Session *session = pools[connection->reactor - reactors].sessions.get();
+
+    session->reset(connection);
+
+    return session;
+}
+
+void FireLoop::release(Session *session)
+{
+    if (session == NULL)
+        return;
+    session->connection->counters->bytesInflight.fetch_sub(session->length,
+                                                           std::memory_order_relaxed);
+    /* Don't keep buffer of a large command */
+    if (session->_xml_cmd.capacity() > MAX_RETAINED)
+        string().swap(session->_xml_cmd);
+    pools[session->connection->reactor - reactors].sessions.put(session);
+}
+
+void FireLoop::release(Connection *connection)
+{
+    unsigned int posted;
+
+    if (connection->reading != NULL) {
+        release(connection->reading);
+        connection->reading = NULL;
+    }
+    pthread_mutex_lock(&connection->writeLock);
+    posted = connection->posted;
+    pthread_mutex_unlock(&connection->writeLock);
+    connection->released = true;
+    /* Last posted watchOutput() puts it */
+    if (posted > 0)
+        return;
+    pools[connection->reactor - reactors].connections.put(connection);
 }
 
 void FireLoop::fire_failed(Session *session, const string message)
@@ -331,50 +1940,370 @@ void FireLoop::fire_failed(Session *session, const string message)
     Exception exception(message, TracePoint("fireloop"));
 
     answer_failed(session, exception);
-    close(session->socket_fd);
-    delete session;
-
-    pthread_exit(NULL);
+    session->connection->reactor->post(complete, session);
 }
 
 void FireLoop::answer_ok(const Session *session, const string &des)
 {
-    Response response;
-
-    response.set_description(des);
-    writeResponse(session, response.xml());
+    respond(session, ResponseStatus::SUCCESS, des);
 }
 
 void FireLoop::answer_failed(const Session *session, const Exception &e)
 {
-    Response response;
+    int status = ResponseStatus::SUCCESS;
 
     if (e.is_nok())
-        response.set_status(ResponseStatus::WARNING);
+        status = ResponseStatus::WARNING;
     else if (e.is_failed())
-        response.set_status(ResponseStatus::FAILED);
-    response.set_description(e.xml() + ((e.is_nok()) ? e.get_nokDesc() : ""));
-    writeResponse(session, response.xml());
+        status = ResponseStatus::FAILED;
+    respond(session, status, e.xml() + ((e.is_nok()) ? e.get_nokDesc() : ""));
+}
+
+void FireLoop::respond(const Session *session, int status, const string &des)
+{
+    string message;
+    unsigned long long started = Metrics::now();
+    unsigned long long serialized;
+
+    Response::serialize(message, status, des);
+    serialized = Metrics::now();
+    writeResponse(session, message);
+    Metrics::record(session->sid, session->cid, Metrics::SERIALIZE, serialized - started);
+    Metrics::record(session->sid, session->cid, Metrics::WRITE, Metrics::now() - serialized);
+}
+
+void FireLoop::set_routingTags(const string sysID, const string cmdID, const string token)
+{
+    sysIDTag = sysID;
+    cmdIDTag = cmdID;
+    tokenTag = token;
+}
+
+bool FireLoop::decodeBinary(Session *session, bool &xml)
+{
+    const unsigned char *header = (const unsigned char *) session->_xml_cmd.data();
+    size_t length = session->_xml_cmd.length();
+    unsigned int flags;
+    size_t tokenLength;
+
+    if (length < BINARY_HEADER)
+        return false;
+    session->sid = (int32_t) (((uint32_t) header[0] << 24) | (header[1] << 16) | (header[2] << 8) |
+                              header[3]);
+    session->cid = (int32_t) (((uint32_t) header[4] << 24) | (header[5] << 16) | (header[6] << 8) |
+                              header[7]);
+    flags = (header[8] << 8) | header[9];
+    tokenLength = (header[10] << 8) | header[11];
+    if ((flags & ~BINARY_XML) || (tokenLength > length - BINARY_HEADER))
+        return false;
+    session->token.assign((const char *) header + BINARY_HEADER, tokenLength);
+    session->payload = (const char *) header + BINARY_HEADER + tokenLength;
+    session->payloadLength = length - BINARY_HEADER - tokenLength;
+    xml = flags & BINARY_XML;
+
+    return true;
 }
 
-void FireLoop::writeResponse(const Session *session, const string response)
+int FireLoop::prescan(const string &command, long &sid, long &cid, string &token)
 {
-    char buffer[10];
-    int bytesWritten;
-    size_t length = response.length();
-    string _response;
+    const char *position = command.data();
+    const char *end = position + command.length();
+    const char *name;
+    const char *text;
+    const char *close;
+    char quote;
+    size_t nameLength;
+    int depth = 0;
+    bool root = false;
+    bool selfClosing;
+    bool hasSid = false;
+    bool hasCid = false;
+    string value;
+    char *last;
 
-    snprintf(buffer, sizeof(buffer), "%ld:", length);
-    _response = buffer + response;
-    length = _response.length();
-    while (length > 0) {
-        bytesWritten = write(session->socket_fd, _response.c_str() + (_response.length() - length),
-                             length);
-        if (bytesWritten == -1)
+    while (position < end) {
+        position = static_cast<const char *>(memchr(position, '<', end - position));
+        if (position == NULL)
+            break;
+        if (++position == end)
+            return PRESCAN_MALFORMED;
+        if ((*position == '?') || (*position == '!')) {
+            /* Declarations, comments and CDATA sections */
+            if ((end - position >= 3) && (memcmp(position, "!--", 3) == 0))
+                close = strstr(position, "-->");
+            else if ((end - position >= 8) && (memcmp(position, "![CDATA[", 8) == 0))
+                close = strstr(position, "]]>");
+            else
+                close = static_cast<const char *>(memchr(position, '>', end - position));
+            if ((close == NULL) || (close >= end))
+                return PRESCAN_MALFORMED;
+            position = close + 1;
+            continue;
+        }
+        if (*position == '/') {
+            close = static_cast<const char *>(memchr(position, '>', end - position));
+            if ((close == NULL) || (--depth < 0))
+                return PRESCAN_MALFORMED;
+            position = close + 1;
+            if (depth == 0)
+                break;
+            continue;
+        }
+        name = position;
+        while ((position < end) && ! isspace((unsigned char) *position) && (*position != '>') &&
+               (*position != '/'))
+            position++;
+        nameLength = position - name;
+        /* Skip attributes, minding quoted '>' */
+        for (quote = 0; (position < end) && (quote || (*position != '>')); ++position) {
+            if (quote && (*position == quote))
+                quote = 0;
+            else if (! quote && ((*position == '"') || (*position == '\'')))
+                quote = *position;
+        }
+        if ((position == end) || (nameLength == 0))
+            return PRESCAN_MALFORMED;
+        selfClosing = (*(position - 1) == '/');
+        text = ++position;
+        if (depth == 0) {
+            if (root)
+                return PRESCAN_MALFORMED;
+            root = true;
+        }
+        if ((depth == 1) && ! selfClosing) {
+            close = static_cast<const char *>(memchr(text, '<', end - text));
+            if (close == NULL)
+                return PRESCAN_MALFORMED;
+            if ((nameLength == sysIDTag.length()) &&
+                (memcmp(name, sysIDTag.data(), nameLength) == 0)) {
+                value.assign(text, close - text);
+                sid = strtol(value.c_str(), &last, 10);
+                if ((last == value.c_str()) || (*last && ! isspace((unsigned char) *last)))
+                    return PRESCAN_UNKNOWN;
+                hasSid = true;
+            } else if ((nameLength == cmdIDTag.length()) &&
+                       (memcmp(name, cmdIDTag.data(), nameLength) == 0)) {
+                value.assign(text, close - text);
+                cid = strtol(value.c_str(), &last, 10);
+                if ((last == value.c_str()) || (*last && ! isspace((unsigned char) *last)))
+                    return PRESCAN_UNKNOWN;
+                hasCid = true;
+            } else if ((nameLength == tokenTag.length()) &&
+                       (memcmp(name, tokenTag.data(), nameLength) == 0)) {
+                /* Escaped tokens are left to the full parse */
+                if (memchr(text, '&', close - text) != NULL)
+                    return PRESCAN_UNKNOWN;
+                token.assign(text, close - text);
+            }
+        }
+        if (! selfClosing)
+            depth++;
+        else if (depth == 0)
             break;
+    }
+    if (! root || (depth != 0))
+        return PRESCAN_MALFORMED;
+
+    return (hasSid && hasCid) ? PRESCAN_ROUTED : PRESCAN_UNKNOWN;
+}
+
+string FireLoop::get_traces()
+{
+    vector<Tracer::Timeline> timelines = Tracer::dump();
+    unsigned long long now = Metrics::now();
+    string out;
+
+    out.reserve(64 + timelines.size() * 256);
+    out += "<traces>";
+    for (size_t i = 0; i < timelines.size(); ++i) {
+        const Tracer::Timeline &timeline = timelines[i];
+        const unsigned long long points[] = {timeline.framed,      timeline.parsed,
+                                             timeline.actionStart, timeline.actionEnd,
+                                             timeline.written};
+        const char *names[] = {"framed", "parsed", "actionStart", "actionEnd", "written"};
+
+        out += "<trace";
+        attribute(out, "sequence", timeline.sequence);
+        attribute(out, "sid", std::to_string(timeline.sid));
+        attribute(out, "cid", std::to_string(timeline.cid));
+        if (timeline.tag[0] != '\0')
+            attribute(out, "tag", string(timeline.tag));
+        attribute(out, "failed", timeline.failed ? "true" : "false");
+        attribute(out, "ago", now - timeline.firstByte);
+        attribute(out, "connectionAge", timeline.firstByte - timeline.accepted);
+        for (int p = 0; p < 5; ++p) {
+            if (points[p] != 0)
+                attribute(out, names[p], points[p] - timeline.firstByte);
+        }
+        out += "/>";
+    }
+    out += "</traces>";
+
+    return out;
+}
+
+FireLoop::Worker *FireLoop::get_worker()
+{
+    Worker *worker;
+
+    pthread_once(&workerOnce, createWorkerKey);
+    worker = static_cast<Worker *>(pthread_getspecific(workerKey));
+    if (worker == NULL) {
+        worker = new Worker;
+        worker->parser = new XParam::XmlParser;
+        pthread_setspecific(workerKey, worker);
+        /* Once per worker; traced action runs set their own */
+        PLogger::threadInfo(ACTREPO_MODULE, "fire");
+        PLogger::setMode(plogger::ThreadRecorder::TRM_REAL);
+    }
+
+    return worker;
+}
+
+void FireLoop::createWorkerKey()
+{
+    pthread_key_create(&workerKey, destroyWorker);
+}
+
+void FireLoop::destroyWorker(void *_worker)
+{
+    Worker *worker = static_cast<Worker *>(_worker);
+
+    delete worker->parser;
+    delete worker;
+}
 
-        length -= bytesWritten;
+bool FireLoop::known(long sid, long cid)
+{
+    if (stats(sid))
+        return (cid == STATS_SUMMARY) || (cid == STATS_TRACES);
+
+    return ActionRepository::known(sid, cid);
+}
+
+string FireLoop::runStats(XParam::XInt cid)
+{
+    switch (cid) {
+    case STATS_SUMMARY:
+        return get_stats();
+    case STATS_TRACES:
+        return get_traces();
+    default:
+        throw Exception("Bad stats command", TracePoint("fireloop"));
+    }
+}
+
+void FireLoop::attribute(string &out, const char *name, unsigned long long value)
+{
+    char buffer[24];
+
+    out += ' ';
+    out += name;
+    out += "=\"";
+    out.append(buffer, snprintf(buffer, sizeof(buffer), "%llu", value));
+    out += '"';
+}
+
+void FireLoop::attribute(string &out, const char *name, const string &value)
+{
+    out += ' ';
+    out += name;
+    out += "=\"";
+    for (size_t i = 0; i < value.length(); ++i) {
+        switch (value[i]) {
+        case '<':
+            out += "&lt;";
+            break;
+        case '>':
+            out += "&gt;";
+            break;
+        case '&':
+            out += "&amp;";
+            break;
+        case '"':
+            out += "&quot;";
+            break;
+        default:
+            out += value[i];
+        }
+    }
+    out += '"';
+}
+
+void FireLoop::writeResponse(const Session *session, string &response)
+{
+    writeFrame(session, response, false);
+}
+
+void FireLoop::writeBusy(Connection *connection, const string &tag)
+{
+    string response(busyResponse);
+
+    writeFrame(connection, tag, response, false);
+}
+
+void FireLoop::writeFrame(const Session *session, string &payload, bool chunk)
+{
+    writeFrame(session->connection, session->tag, payload, chunk);
+}
+
+void FireLoop::writeFrame(Connection *connection, const string &tag, string &payload, bool chunk)
+{
+    char header[MAX_HEADER];
+    size_t headerLength;
+    size_t written = 0;
+    ssize_t bytesWritten;
+    struct iovec buffers[2];
+    struct msghdr message;
+    bool watch = false;
+
+    headerLength = snprintf(header, sizeof(header), "%zu%s%s%s:", payload.length(),
+                            chunk ? ";c" : "", tag.empty() ? "" : ";t", tag.c_str());
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = buffers;
+    pthread_mutex_lock(&connection->writeLock);
+    /* Frames queued before would be sent first, by reactor */
+    while (connection->output.empty() && ! connection->broken &&
+           (written < headerLength + payload.length())) {
+        message.msg_iovlen = 0;
+        if (written < headerLength) {
+            buffers[message.msg_iovlen].iov_base = header + written;
+            buffers[message.msg_iovlen].iov_len = headerLength - written;
+            message.msg_iovlen++;
+        }
+        buffers[message.msg_iovlen].iov_base =
+            &payload[0] + ((written > headerLength) ? written - headerLength : 0);
+        buffers[message.msg_iovlen].iov_len =
+            payload.length() - ((written > headerLength) ? written - headerLength : 0);
+        message.msg_iovlen++;
+        bytesWritten = sendmsg(connection->socket_fd, &message, MSG_NOSIGNAL);
+        if (bytesWritten == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                connection->broken = true;
+            break;
+        }
+        written += bytesWritten;
+    }
+    connection->counters->bytesOut.fetch_add(written, std::memory_order_relaxed);
+    /* Queue the rest; payload content is taken over, not copied */
+    if (! connection->broken && (written < headerLength + payload.length())) {
+        watch = connection->output.empty();
+        connection->outputBytes += headerLength + payload.length() - written;
+        if (watch)
+            connection->outputOffset = (written > headerLength) ? written - headerLength : 0;
+        if (written < headerLength)
+            connection->output.push_back(string(header + written, headerLength - written));
+        connection->output.push_back(string());
+        connection->output.back().swap(payload);
+        if (watch)
+            connection->posted++;
     }
+    pthread_mutex_unlock(&connection->writeLock);
+    if (watch)
+        connection->reactor->post(watchOutput, connection);
 }
 
 } // namespace actrepo
@@ -0,0 +1,58 @@
+#include "gate.hpp"
+
+namespace actrepo
+{
+
+Gate::Gate(unsigned int limit) : limit(limit), running(0), rejected(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+Gate::~Gate()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+void Gate::set_limit(unsigned int _limit)
+{
+    pthread_mutex_lock(&mutex);
+    limit = _limit;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Gate::enter()
+{
+    bool entered;
+
+    pthread_mutex_lock(&mutex);
+    entered = (running < limit);
+    if (entered)
+        running++;
+    else
+        rejected++;
+    pthread_mutex_unlock(&mutex);
+
+    return entered;
+}
+
+void Gate::leave()
+{
+    pthread_mutex_lock(&mutex);
+    running--;
+    pthread_mutex_unlock(&mutex);
+}
+
+Gate::Stats Gate::get_stats()
+{
+    Stats stats;
+
+    pthread_mutex_lock(&mutex);
+    stats.limit = limit;
+    stats.running = running;
+    stats.rejected = rejected;
+    pthread_mutex_unlock(&mutex);
+
+    return stats;
+}
+
+} // namespace actrepo
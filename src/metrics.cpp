@@ -0,0 +1,244 @@
+#include "metrics.hpp"
+
+namespace actrepo
+{
+
+const std::string Metrics::phaseString[PHASES] = {"read",   "queue",     "parse",
+                                                  "action", "serialize", "write"};
+const std::string Metrics::counterString[COUNTERS] = {"errors", "rejected", "cached"};
+
+__thread Metrics::Table *Metrics::local = NULL;
+pthread_mutex_t Metrics::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Metrics::Table *> Metrics::tables;
+std::vector<Metrics::Table *> Metrics::spare;
+pthread_key_t Metrics::key;
+pthread_once_t Metrics::keyOnce = PTHREAD_ONCE_INIT;
+std::atomic<Metrics::FT_known> Metrics::known(NULL);
+std::atomic<bool> Metrics::enabled(true);
+
+void Metrics::record(long sid, long cid, Phase phase, unsigned long long duration)
+{
+    Entry *entry;
+    Histogram *histogram;
+
+    if (! enabled.load(std::memory_order_relaxed))
+        return;
+    entry = lookup(sid, cid);
+    if (entry == NULL)
+        return;
+    histogram = entry->phases[phase].load(std::memory_order_relaxed);
+    if (histogram == NULL) {
+        histogram = new (std::nothrow) Histogram();
+        if (histogram == NULL)
+            return;
+        entry->phases[phase].store(histogram, std::memory_order_release);
+    }
+    add(histogram->buckets[bucket(duration)], 1);
+    add(histogram->count, 1);
+    add(histogram->total, duration);
+    if (duration > histogram->max.load(std::memory_order_relaxed))
+        histogram->max.store(duration, std::memory_order_relaxed);
+}
+
+void Metrics::count(long sid, long cid, Counter counter)
+{
+    Entry *entry;
+
+    if (! enabled.load(std::memory_order_relaxed))
+        return;
+    entry = lookup(sid, cid);
+    if (entry != NULL)
+        add(entry->counters[counter], 1);
+}
+
+void Metrics::set_enabled(bool enable)
+{
+    enabled.store(enable);
+}
+
+void Metrics::set_known(FT_known _known)
+{
+    known.store(_known);
+}
+
+std::vector<Metrics::Record> Metrics::snapshot()
+{
+    std::map<std::pair<long, long>, Merged> commands;
+    std::map<std::pair<long, long>, Merged>::iterator command;
+    std::vector<Table *> _tables;
+    std::vector<Record> records;
+    Histogram *histogram;
+    Entry *entry;
+
+    pthread_mutex_lock(&mutex);
+    _tables = tables;
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t t = 0; t < _tables.size(); ++t) {
+        for (int i = 0; i < TABLE_SIZE; ++i) {
+            entry = &_tables[t]->entries[i];
+            if (! entry->used.load(std::memory_order_acquire))
+                continue;
+            command = commands.find(std::make_pair(entry->sid, entry->cid));
+            if (command == commands.end()) {
+                Merged merged = Merged();
+
+                command = commands.insert(std::make_pair(std::make_pair(entry->sid, entry->cid),
+                                                         merged)).first;
+            }
+
+            Merged &merged = command->second;
+
+            for (int c = 0; c < COUNTERS; ++c)
+                merged.counters[c] += entry->counters[c].load(std::memory_order_relaxed);
+            for (int p = 0; p < PHASES; ++p) {
+                histogram = entry->phases[p].load(std::memory_order_acquire);
+                if (histogram == NULL)
+                    continue;
+                merged.buckets[p].resize(BUCKETS);
+                for (int b = 0; b < BUCKETS; ++b)
+                    merged.buckets[p][b] += histogram->buckets[b].load(std::memory_order_relaxed);
+                merged.count[p] += histogram->count.load(std::memory_order_relaxed);
+                merged.total[p] += histogram->total.load(std::memory_order_relaxed);
+                if (histogram->max.load(std::memory_order_relaxed) > merged.max[p])
+                    merged.max[p] = histogram->max.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    for (command = commands.begin(); command != commands.end(); ++command) {
+        Record record;
+
+        record.sid = command->first.first;
+        record.cid = command->first.second;
+        for (int c = 0; c < COUNTERS; ++c)
+            record.counters[c] = command->second.counters[c];
+        for (int p = 0; p < PHASES; ++p)
+            summarize(command->second, p, record.phases[p]);
+        records.push_back(record);
+    }
+
+    return records;
+}
+
+Metrics::Entry *Metrics::lookup(long sid, long cid)
+{
+    unsigned long hash;
+    Entry *entry;
+    FT_known _known;
+
+    if (local == NULL) {
+        local = acquire();
+        if (local == NULL)
+            return NULL;
+    }
+    hash = (unsigned long) sid * 2654435761UL + (unsigned long) cid;
+    for (int probe = 0; probe < TABLE_SIZE; ++probe) {
+        entry = &local->entries[(hash + probe) % TABLE_SIZE];
+        if (! entry->used.load(std::memory_order_relaxed)) {
+            /* Bogus ids would fill the table for good */
+            _known = known.load(std::memory_order_relaxed);
+            if ((sid != UNKNOWN) && (_known != NULL) && ! _known(sid, cid))
+                return lookup(UNKNOWN, UNKNOWN);
+            /* Only this thread inserts into its table */
+            entry->sid = sid;
+            entry->cid = cid;
+            entry->used.store(true, std::memory_order_release);
+
+            return entry;
+        }
+        if ((entry->sid == sid) && (entry->cid == cid))
+            return entry;
+    }
+
+    return NULL;
+}
+
+Metrics::Table *Metrics::acquire()
+{
+    Table *table = NULL;
+
+    pthread_once(&keyOnce, createKey);
+    pthread_mutex_lock(&mutex);
+    if (! spare.empty()) {
+        table = spare.back();
+        spare.pop_back();
+    } else {
+        table = new (std::nothrow) Table();
+        if (table != NULL)
+            tables.push_back(table);
+    }
+    pthread_mutex_unlock(&mutex);
+    if (table != NULL)
+        pthread_setspecific(key, table);
+
+    return table;
+}
+
+void Metrics::release(void *table)
+{
+    /* Recorded metrics stay in table, new owner adds to them */
+    pthread_mutex_lock(&mutex);
+    spare.push_back(static_cast<Table *>(table));
+    pthread_mutex_unlock(&mutex);
+}
+
+void Metrics::createKey()
+{
+    pthread_key_create(&key, release);
+}
+
+int Metrics::bucket(unsigned long long value)
+{
+    int exponent;
+
+    if (value < (1ULL << SUB_BITS))
+        return value;
+    if (value >= (1ULL << MAX_BITS))
+        return BUCKETS - 1;
+    exponent = 63 - __builtin_clzll(value);
+
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) +
+           ((value >> (exponent - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+unsigned long long Metrics::lowest(int bucket)
+{
+    int exponent;
+
+    if (bucket < (1 << SUB_BITS))
+        return bucket;
+    exponent = (bucket >> SUB_BITS) + SUB_BITS - 1;
+
+    return ((1ULL << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1))) << (exponent - SUB_BITS);
+}
+
+void Metrics::summarize(const Merged &merged, int phase, Summary &summary)
+{
+    const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    unsigned long long *values[] = {&summary.p50, &summary.p90, &summary.p99, &summary.p999};
+    unsigned long long cumulative = 0;
+    unsigned long long target;
+    unsigned long long count = 0;
+    int b = 0;
+
+    summary.count = merged.count[phase];
+    summary.total = merged.total[phase];
+    summary.max = merged.max[phase];
+    for (size_t i = 0; i < merged.buckets[phase].size(); ++i)
+        count += merged.buckets[phase][i];
+    for (int p = 0; p < 4; ++p) {
+        *values[p] = 0;
+        if (count == 0)
+            continue;
+        target = (unsigned long long) (percentiles[p] * count + 0.999999);
+        while ((b < BUCKETS) && (cumulative + merged.buckets[phase][b] < target))
+            cumulative += merged.buckets[phase][b++];
+        /* Report the highest duration of bucket, bounded by max */
+        *values[p] = (b + 1 < BUCKETS) ? lowest(b + 1) - 1 : summary.max;
+        if (*values[p] > summary.max)
+            *values[p] = summary.max;
+    }
+}
+
+} // namespace actrepo
@@ -21,6 +21,8 @@ string Translator::getLogFormat(plogger::LogID logID)
         return "Bad action id.";
     case L_ACTREPO_BAD_MODULE:
         return "Bad module id.";
+    case L_ACTREPO_BUSY:
+        return "Action is busy.";
     default:
         return PLOGGER_NONE;
     };
@@ -0,0 +1,200 @@
+#include "reactor.hpp"
+
+namespace actrepo
+{
+
+Reactor::Reactor() :
+    epollFD(-1),
+    eventFD(-1),
+    expired(NULL),
+    tick(milliseconds() / TICK),
+    timers(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    memset(wheel, 0, sizeof(wheel));
+}
+
+Reactor::~Reactor()
+{
+    if (eventFD != -1)
+        close(eventFD);
+    if (epollFD != -1)
+        close(epollFD);
+    pthread_mutex_destroy(&mutex);
+}
+
+void Reactor::create()
+{
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD == -1)
+        throw Exception(string("epoll_create1: ") + strerror(errno), TracePoint("reactor"));
+    eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFD == -1)
+        throw Exception(string("eventfd: ") + strerror(errno), TracePoint("reactor"));
+    eventWatch.fd = eventFD;
+    eventWatch.handler = runTasks;
+    eventWatch.data = NULL;
+    add(&eventWatch, INPUT);
+}
+
+void Reactor::add(Watch *watch, unsigned int events)
+{
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = watch;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, watch->fd, &event) == -1)
+        throw Exception(string("epoll_ctl(ADD): ") + strerror(errno), TracePoint("reactor"));
+}
+
+void Reactor::modify(Watch *watch, unsigned int events)
+{
+    struct epoll_event event;
+
+    event.events = events;
+    event.data.ptr = watch;
+    if (epoll_ctl(epollFD, EPOLL_CTL_MOD, watch->fd, &event) == -1)
+        throw Exception(string("epoll_ctl(MOD): ") + strerror(errno), TracePoint("reactor"));
+}
+
+void Reactor::remove(Watch *watch)
+{
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+void Reactor::post(FT_task task, void *data)
+{
+    Task entry = {task, data};
+    bool wakeup;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&mutex);
+    wakeup = tasks.empty();
+    tasks.push_back(entry);
+    pthread_mutex_unlock(&mutex);
+    if (wakeup && (write(eventFD, &one, sizeof(one)) == -1) && (errno != EAGAIN))
+        throw Exception(string("eventfd write: ") + strerror(errno), TracePoint("reactor"));
+}
+
+void Reactor::schedule(Timer *timer, unsigned long long timeout)
+{
+    unsigned long long current = milliseconds();
+
+    cancel(timer);
+    /* Wheel isn't turned while no timer is armed */
+    if (timers == 0)
+        tick = current / TICK;
+    /* Round up, so that timer never expires early */
+    timer->expires = (current + timeout + TICK - 1) / TICK;
+    if (timer->expires <= tick)
+        timer->expires = tick + 1;
+    link(timer, &wheel[timer->expires % SLOTS]);
+}
+
+void Reactor::cancel(Timer *timer)
+{
+    if (timer->list == NULL)
+        return;
+    if (timer->prev != NULL)
+        timer->prev->next = timer->next;
+    else
+        *timer->list = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->list = NULL;
+    timer->prev = timer->next = NULL;
+    timers--;
+}
+
+void Reactor::link(Timer *timer, Timer **list)
+{
+    timer->list = list;
+    timer->prev = NULL;
+    timer->next = *list;
+    if (*list != NULL)
+        (*list)->prev = timer;
+    *list = timer;
+    timers++;
+}
+
+void Reactor::expireTimers()
+{
+    unsigned long long current = milliseconds() / TICK;
+    unsigned long long ticks;
+    Timer *timer;
+    Timer *next;
+
+    if (timers == 0) {
+        tick = current;
+
+        return;
+    }
+    /* Move expired timers out of wheel first; their tasks may arm or cancel
+     * any timer. After a long stall, each slot is visited once.
+     */
+    ticks = (current - tick < SLOTS) ? current - tick : SLOTS;
+    for (unsigned long long i = 1; i <= ticks; ++i) {
+        for (timer = wheel[(tick + i) % SLOTS]; timer != NULL; timer = next) {
+            next = timer->next;
+            if (timer->expires <= current) {
+                cancel(timer);
+                link(timer, &expired);
+            }
+        }
+    }
+    tick = current;
+    while (expired != NULL) {
+        timer = expired;
+        cancel(timer);
+        timer->task(this, timer->data);
+    }
+}
+
+unsigned long long Reactor::milliseconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void Reactor::runTasks(Reactor *reactor, unsigned int events, void *data)
+{
+    uint64_t count;
+
+    if (read(reactor->eventFD, &count, sizeof(count)) == -1)
+        return;
+    pthread_mutex_lock(&reactor->mutex);
+    reactor->running.swap(reactor->tasks);
+    pthread_mutex_unlock(&reactor->mutex);
+    for (size_t i = 0; i < reactor->running.size(); ++i)
+        reactor->running[i].task(reactor, reactor->running[i].data);
+    reactor->running.clear();
+}
+
+void Reactor::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+    Watch *watch;
+    int ready;
+    int timeout;
+
+    while (true) {
+        /* Wake up at next tick while timers are armed */
+        timeout = (timers > 0) ? (int) (TICK - milliseconds() % TICK) : -1;
+        ready = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            throw Exception(string("epoll_wait: ") + strerror(errno), TracePoint("reactor"));
+        }
+        for (int i = 0; i < ready; ++i) {
+            watch = static_cast<Watch *>(events[i].data.ptr);
+            watch->handler(this, events[i].events, watch->data);
+        }
+        expireTimers();
+    }
+}
+
+} // namespace actrepo
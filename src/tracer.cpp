@@ -0,0 +1,117 @@
+#include "tracer.hpp"
+
+namespace actrepo
+{
+
+std::atomic<Tracer::Ring *> Tracer::slots(NULL);
+std::atomic<unsigned int> Tracer::capacity(1024);
+std::atomic<unsigned long long> Tracer::head(0);
+std::atomic<unsigned int> Tracer::rate(1000);
+std::atomic<unsigned long long> Tracer::threshold(500000000ULL);
+__thread unsigned int Tracer::requests = 0;
+
+void Tracer::set_sampling(unsigned int _rate, unsigned long long _threshold)
+{
+    rate.store(_rate, std::memory_order_relaxed);
+    threshold.store(_threshold * 1000, std::memory_order_relaxed);
+}
+
+void Tracer::set_capacity(unsigned int _capacity)
+{
+    /* Ring keeps the capacity it's allocated with */
+    if ((_capacity > 0) && (slots.load() == NULL))
+        capacity.store(_capacity);
+}
+
+bool Tracer::sampled(unsigned long long elapsed)
+{
+    unsigned int _rate = rate.load(std::memory_order_relaxed);
+    unsigned long long _threshold = threshold.load(std::memory_order_relaxed);
+
+    if ((_threshold > 0) && (elapsed >= _threshold))
+        return true;
+
+    return (_rate > 0) && ((++requests % _rate) == 0);
+}
+
+void Tracer::record(const Timeline &timeline)
+{
+    Ring *_ring = ring();
+    Slot *slot;
+    unsigned long long ticket;
+    unsigned long long sequence;
+
+    if (_ring == NULL)
+        return;
+    ticket = head.fetch_add(1, std::memory_order_relaxed);
+    slot = _ring->slots + ticket % _ring->capacity;
+    sequence = slot->sequence.load(std::memory_order_relaxed);
+    if ((sequence & 1) ||
+        ! slot->sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                 std::memory_order_acquire))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->timeline = timeline;
+    slot->timeline.sequence = ticket;
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+std::vector<Tracer::Timeline> Tracer::dump()
+{
+    std::vector<Timeline> timelines;
+    Ring *_ring = slots.load(std::memory_order_acquire);
+    Slot *slot;
+    unsigned long long before;
+    Timeline timeline;
+
+    if (_ring == NULL)
+        return timelines;
+    slot = _ring->slots;
+    for (unsigned int i = 0; i < _ring->capacity; ++i) {
+        before = slot[i].sequence.load(std::memory_order_acquire);
+        if ((before == 0) || (before & 1))
+            continue;
+        timeline = slot[i].timeline;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot[i].sequence.load(std::memory_order_relaxed) != before)
+            continue;
+        timelines.push_back(timeline);
+    }
+    std::sort(timelines.begin(), timelines.end(), older);
+
+    return timelines;
+}
+
+bool Tracer::older(const Timeline &a, const Timeline &b)
+{
+    return a.sequence < b.sequence;
+}
+
+Tracer::Ring *Tracer::ring()
+{
+    Ring *ring = slots.load(std::memory_order_acquire);
+    Ring *allocated;
+
+    if (ring != NULL)
+        return ring;
+    allocated = new (std::nothrow) Ring;
+    if (allocated == NULL)
+        return NULL;
+    allocated->capacity = capacity.load();
+    allocated->slots = new (std::nothrow) Slot[allocated->capacity]();
+    if (allocated->slots == NULL) {
+        delete allocated;
+
+        return NULL;
+    }
+    if (! slots.compare_exchange_strong(ring, allocated, std::memory_order_acq_rel)) {
+        delete[] allocated->slots;
+        delete allocated;
+
+        return ring;
+    }
+
+    return allocated;
+}
+
+} // namespace actrepo
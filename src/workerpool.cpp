@@ -0,0 +1,198 @@
+#include "workerpool.hpp"
+
+namespace actrepo
+{
+
+LogSystem WorkerPool::log("workerpool");
+
+WorkerPool::WorkerPool(const string name) : name(name)
+{
+    pthread_condattr_t attribute;
+
+    pthread_condattr_init(&attribute);
+    pthread_condattr_setclock(&attribute, CLOCK_MONOTONIC);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&notEmpty, &attribute);
+    pthread_cond_init(&notFull, &attribute);
+    pthread_condattr_destroy(&attribute);
+    memset(&stats, 0, sizeof(stats));
+}
+
+WorkerPool::~WorkerPool()
+{
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&mutex);
+}
+
+void WorkerPool::start(unsigned int threads, unsigned int queueSize)
+{
+    pthread_attr_t threadAttribute;
+    pthread_t threadID;
+
+    if ((threads == 0) || (queueSize == 0))
+        throw Exception("Bad worker pool size", TracePoint("workerpool"));
+    for (int i = 0; i < ActionPolicy::PRIORITIES; ++i) {
+        lanes[i].queue.resize(queueSize);
+        lanes[i].head = 0;
+    }
+    stats.queueSize = queueSize;
+
+    if (pthread_attr_init(&threadAttribute) != 0)
+        throw Exception(string("pthread_attr_init: ") + strerror(errno), TracePoint("workerpool"));
+    pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_DETACHED);
+    for (; stats.threads < threads; ++stats.threads) {
+        if (pthread_create(&threadID, &threadAttribute, worker, this)) {
+            pthread_attr_destroy(&threadAttribute);
+            throw Exception(string("Failed to create worker - ") + strerror(errno),
+                            TracePoint("workerpool"));
+        }
+    }
+    pthread_attr_destroy(&threadAttribute);
+}
+
+bool WorkerPool::submit(FT_job job, void *data, unsigned int timeout,
+                        ActionPolicy::Priority priority)
+{
+    struct timespec deadline;
+    unsigned int &queued = stats.laneQueued[priority];
+
+    pthread_mutex_lock(&mutex);
+    if ((queued == stats.queueSize) && (timeout > 0)) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (queued == stats.queueSize) {
+            if (pthread_cond_timedwait(&notFull, &mutex, &deadline) == ETIMEDOUT)
+                break;
+        }
+    }
+    if (queued == stats.queueSize) {
+        stats.rejected++;
+        pthread_mutex_unlock(&mutex);
+
+        return false;
+    }
+    push(job, data, priority);
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+bool WorkerPool::offer(FT_job job, void *data, ActionPolicy::Priority priority)
+{
+    pthread_mutex_lock(&mutex);
+    if (stats.laneQueued[priority] == stats.queueSize) {
+        pthread_mutex_unlock(&mutex);
+
+        return false;
+    }
+    push(job, data, priority);
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+void WorkerPool::push(FT_job job, void *data, ActionPolicy::Priority priority)
+{
+    Lane &lane = lanes[priority];
+    Job *entry = &lane.queue[(lane.head + stats.laneQueued[priority]) % stats.queueSize];
+
+    entry->job = job;
+    entry->data = data;
+    clock_gettime(CLOCK_MONOTONIC, &entry->queued);
+    stats.laneQueued[priority]++;
+    stats.queued++;
+    stats.submitted++;
+    if (stats.queued > stats.maxQueued)
+        stats.maxQueued = stats.queued;
+    pthread_cond_signal(&notEmpty);
+}
+
+unsigned int WorkerPool::get_queued()
+{
+    unsigned int queued;
+
+    pthread_mutex_lock(&mutex);
+    queued = stats.queued;
+    pthread_mutex_unlock(&mutex);
+
+    return queued;
+}
+
+WorkerPool::Stats WorkerPool::get_stats()
+{
+    Stats _stats;
+
+    pthread_mutex_lock(&mutex);
+    _stats = stats;
+    pthread_mutex_unlock(&mutex);
+
+    return _stats;
+}
+
+void *WorkerPool::worker(void *_pool)
+{
+    WorkerPool *pool = static_cast<WorkerPool *>(_pool);
+    unsigned long long wait;
+    Job job;
+    int priority;
+
+    PLogger::threadInfo(ACTREPO_MODULE, pool->name);
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->stats.queued == 0)
+            pthread_cond_wait(&pool->notEmpty, &pool->mutex);
+        /* Highest priority first */
+        for (priority = 0; pool->stats.laneQueued[priority] == 0; ++priority)
+            ;
+        job = pool->lanes[priority].queue[pool->lanes[priority].head];
+        pool->lanes[priority].head = (pool->lanes[priority].head + 1) % pool->stats.queueSize;
+        pool->stats.laneQueued[priority]--;
+        pool->stats.queued--;
+        pool->stats.busy++;
+        wait = elapsed(job.queued);
+        pool->stats.totalWait += wait;
+        if (wait > pool->stats.maxWait)
+            pool->stats.maxWait = wait;
+        pthread_cond_broadcast(&pool->notFull);
+        pthread_mutex_unlock(&pool->mutex);
+
+        /* A failed job must not take the worker down */
+        try {
+            job.job(job.data);
+        } catch (Exception &e) {
+            log << LogLevel::ERROR << "Job of " + pool->name + " failed: " + e.xml();
+        } catch (std::exception &e) {
+            log << LogLevel::ERROR << "Job of " + pool->name + " failed: " + e.what();
+        } catch (abi::__forced_unwind &) {
+            /* Thread cancellation unwinds through here; glibc aborts if it's
+             * swallowed.
+             */
+            throw;
+        } catch (...) {
+            log << LogLevel::ERROR << "Job of " + pool->name + " failed";
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->stats.busy--;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+unsigned long long WorkerPool::elapsed(const struct timespec &since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since.tv_sec) * 1000000ULL + (now.tv_nsec - since.tv_nsec) / 1000;
+}
+
+} // namespace actrepo